@@ -31,6 +31,7 @@
 
 #include "../common/defines.h"
 #include "backend_private.h"
+#include "cancel.h"
 #include "certutil.h"
 
 
@@ -88,6 +89,32 @@ void backend_freeNotifier(BackendNotifier *notifier) {
     free(notifier);
 }
 
+/**
+ * Changes the subject filter and notification function of a notifier.
+ * This is used to give tokens that were found in advance to the user
+ * interface. Tokens that have been added already are not checked against
+ * the new filter (see token_matchesSubjectFilter).
+ */
+void backend_setNotifyFunction(BackendNotifier *notifier,
+                               const char *subjectFilter,
+                               BackendNotifyFunction notifyFunction) {
+    free(notifier->subjectFilter);
+    notifier->subjectFilter = (subjectFilter ? strdup(subjectFilter) : NULL);
+    notifier->notifyFunction = notifyFunction;
+}
+
+/**
+ * Changes the notification function of a notifier, and returns the
+ * previous one. This is used to collect the tokens of a file before they
+ * are passed on (see keystore.c).
+ */
+BackendNotifyFunction backend_swapNotifyFunction(
+    BackendNotifier *notifier, BackendNotifyFunction notifyFunction) {
+    BackendNotifyFunction previous = notifier->notifyFunction;
+    notifier->notifyFunction = notifyFunction;
+    return previous;
+}
+
 /**
  * Manually adds a soft token. The "tag" is assigned to the token, and can
  * point to anything (for example, the filename).
@@ -105,6 +132,42 @@ TokenError backend_addFile(BackendNotifier *notifier,
     return lastError;
 }
 
+/**
+ * Lists the certificates in a file, so they can be stored in the key index.
+ */
+TokenError backend_indexFile(BackendNotifier *notifier,
+                             const char *file, size_t length,
+                             KeyIndexEntry *entry) {
+    TokenError lastError = TokenError_Unknown;
+    for (size_t i = 0; i < notifier->backendCount; i++) {
+        Backend *backend = notifier->backends[i];
+        if (backend->indexFile) {
+            lastError = backend->indexFile(backend, file, length, entry);
+            if (!lastError) break;
+            keyindex_freeEntry(entry);
+        }
+    }
+    return lastError;
+}
+
+/**
+ * Adds the tokens of a file that is in the key index. The file is read
+ * when a token is used.
+ */
+TokenError backend_addIndexedFile(BackendNotifier *notifier,
+                                  const KeyIndexEntry *entry,
+                                  const char *filename, void *tag) {
+    TokenError lastError = TokenError_Unknown;
+    for (size_t i = 0; i < notifier->backendCount; i++) {
+        Backend *backend = notifier->backends[i];
+        if (backend->addIndexedFile) {
+            lastError = backend->addIndexedFile(backend, entry, filename, tag);
+            if (!lastError) break;
+        }
+    }
+    return lastError;
+}
+
 /**
  * Scan backends for tokens
  */
@@ -112,6 +175,7 @@ void backend_scanTokens(BackendNotifier *notifier)
 {
     for (size_t i = 0; i < notifier->backendCount; i++) {
         Backend *backend = notifier->backends[i];
+        if (cancel_isRequested()) break;
         if (backend->scan) {
             backend->scan(backend);
         }
@@ -190,6 +254,18 @@ void token_usePassword(Token *token, const char *password) {
     token->lastError = TokenError_Success;
 }
 
+/**
+ * Keeps the key unlocked between calls to token_sign, so several messages
+ * can be signed with only one password entry. Call again with keep=false
+ * to lock it again.
+ */
+void token_keepKey(Token *token, bool keep) {
+    token->keepKey = keep;
+    if (!keep && token->backend->releaseKey) {
+        token->backend->releaseKey(token);
+    }
+}
+
 /**
  * Gets the tokens certificate chain.
  */
@@ -216,6 +292,27 @@ bool token_remove(Token *token) {
     return false;
 }
 
+/**
+ * Replaces the contents of a token with those of a new token for the same
+ * key, for example after the key file has changed. The new token is freed.
+ * The token keeps its identity, so it stays in the user interface. Returns
+ * false (and leaves both tokens unchanged) if they are for different keys.
+ */
+bool token_replace(Token *token, Token *replacement) {
+    if (token->backend != replacement->backend) return false;
+    if (!token->backend->replaceToken) return false;
+    return token->backend->replaceToken(token, replacement);
+}
+
+/**
+ * Checks if a token matches a subject filter (which may be NULL).
+ */
+bool token_matchesSubjectFilter(const Token *token, const char *subjectFilter) {
+    if (!subjectFilter) return true;
+    if (!token->backend->matchSubjectFilter) return false;
+    return token->backend->matchSubjectFilter(token, subjectFilter);
+}
+
 /**
  * Free's a token. Don't free a token until it has been removed.
  */
@@ -27,6 +27,7 @@
 
 #include <stdbool.h>
 #include "../common/bidtypes.h"
+#include "keyindex.h"
 
 typedef struct Token Token;
 
@@ -68,6 +69,8 @@ typedef enum  {
     TokenError_BadPin,
     // Key generation errors
     TokenError_NoRandomState,
+    // The request was cancelled (see cancel.h)
+    TokenError_Cancelled,
 } TokenError;
 
 /* Notification methods */
@@ -75,13 +78,26 @@ BackendNotifier *backend_createNotifier(const char *subjectFilter,
                                         KeyUsage keyUsage,
                                         BackendNotifyFunction notifyFunction);
 void backend_freeNotifier(BackendNotifier *notifier);
+void backend_setNotifyFunction(BackendNotifier *notifier,
+                               const char *subjectFilter,
+                               BackendNotifyFunction notifyFunction);
 
+BackendNotifyFunction backend_swapNotifyFunction(
+    BackendNotifier *notifier, BackendNotifyFunction notifyFunction);
 void backend_scanTokens(BackendNotifier *notifier);
 
 /* Function to manually add files */
 TokenError backend_addFile(BackendNotifier *notifier,
                            const char *file, size_t length, void *tag);
 
+/* Functions for files in the key index (see keystore.c) */
+TokenError backend_indexFile(BackendNotifier *notifier,
+                             const char *file, size_t length,
+                             KeyIndexEntry *entry);
+TokenError backend_addIndexedFile(BackendNotifier *notifier,
+                                  const KeyIndexEntry *entry,
+                                  const char *filename, void *tag);
+
 /* Enrollment */
 TokenError backend_createRequest(const RegutilInfo *info,
                                  const char *hostname,
@@ -97,10 +113,13 @@ char *token_getDisplayName(const Token *token);
 void *token_getTag(const Token *token);
 // The password must not be free'd until the signature has been generated
 void token_usePassword(Token *token, const char *password);
+void token_keepKey(Token *token, bool keep);
 bool token_getBase64Chain(Token *token, char ***certs, size_t *count);
 bool token_sign(Token *token, const char *message, size_t messagelen,
                 char **signature, size_t *siglen);
 bool token_remove(Token *token);
+bool token_replace(Token *token, Token *replacement);
+bool token_matchesSubjectFilter(const Token *token, const char *subjectFilter);
 void token_free(Token *token);
 TokenError token_getLastError(const Token *token);
 
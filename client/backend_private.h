@@ -28,6 +28,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include "backend.h"
+#include "keyindex.h"
 
 #ifndef TokenType
     #define TokenType Token
@@ -56,11 +57,40 @@ struct Backend {
      */
     void (*scan)(Backend *backend);
 
+    /**
+     * Checks if a token matches a subject filter. May be NULL if the
+     * backend doesn't have tokens that can be re-used with another
+     * notifier (see backend_setNotifyFunction).
+     */
+    bool (*matchSubjectFilter)(const TokenType *token,
+                               const char *subjectFilter);
+    
+    /**
+     * Moves the contents of a new token for the same key into an existing
+     * token, and frees the new token. Returns false if the tokens are not
+     * for the same key. May be NULL if not applicable
+     */
+    bool (*replaceToken)(TokenType *token, TokenType *replacement);
+    
     /**
      * Manually adds a file to the backend. May be NULL if not applicable
      */
     TokenError (*addFile)(Backend *backend, const char *data, size_t length,
                           void *tag);
+    
+    /**
+     * Lists the certificates in a file, for the key index. May be NULL if
+     * not applicable
+     */
+    TokenError (*indexFile)(Backend *backend, const char *data, size_t length,
+                            KeyIndexEntry *entry);
+    
+    /**
+     * Adds the tokens of a file from the key index, without reading the
+     * file. May be NULL if not applicable
+     */
+    TokenError (*addIndexedFile)(Backend *backend, const KeyIndexEntry *entry,
+                                 const char *filename, void *tag);
                               
     /**
      * Generates a key pair and creates a certificate request for it.
@@ -81,6 +111,12 @@ struct Backend {
     TokenError (*sign)(TokenType *token,
                        const char *message, size_t messagelen,
                        char **signature, size_t *siglen);
+    
+    /**
+     * Forgets an unlocked key that was kept between calls to sign because
+     * keepKey was set. May be NULL if not applicable
+     */
+    void (*releaseKey)(TokenType *token);
 };
 
 struct Token {
@@ -92,6 +128,7 @@ struct Token {
     char *displayName;
     void *tag;
     const char *password;
+    bool keepKey;
 };
 
 struct BackendNotifier {
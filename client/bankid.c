@@ -242,9 +242,11 @@ char *bankid_getVersion() {
 }
 
 /* Authentication and signing objects */
-static const char sign_template[] =
-    "<bankIdSignedData xmlns=\"http://www.bankid.com/signature/v1.0.0/types\" Id=\"bidSignedData\">"
-        "%s" /* Any signed message is inserted here */
+static const char sign_head[] =
+    "<bankIdSignedData xmlns=\"http://www.bankid.com/signature/v1.0.0/types\" Id=\"bidSignedData\">";
+    /* Any signed message is inserted here */
+
+static const char sign_tail_template[] =
         "<srvInfo>"
             "<nonce>%s</nonce>"
             "%s" /* Optional server time value */
@@ -259,16 +261,18 @@ static const char sign_template[] =
         "</clientInfo>"
     "</bankIdSignedData>";
 
-static const char signedText_template[] =
-    "<usrVisibleData charset=\"%s\" visible=\"wysiwys\">"
-        "%s"
+static const char signedText_head_template[] =
+    "<usrVisibleData charset=\"%s\" visible=\"wysiwys\">";
+static const char signedText_tail[] =
     "</usrVisibleData>";
 
-static const char signedInvisibleText_template[] =
-    "<usrNonVisibleData>"
-        "%s"
+static const char signedInvisibleText_head[] =
+    "<usrNonVisibleData>";
+static const char signedInvisibleText_tail[] =
     "</usrNonVisibleData>";
 
+#define MAX_EXTRA_PIECES 6
+
 static const char signobj_id[] = "bidSignedData";
 
 /**
@@ -283,8 +287,9 @@ static const char signobj_id[] = "bidSignedData";
  * @param hostname   Hostname of the server that requested the signature
  * @param ip         IP address of the server
  * @param purpose    Either "Identification" or "Signing"
- * @param extra      Extra data to include. This is generally a
- *                   usrVisibleData tag
+ * @param extra      Extra data to include, in pieces. This is generally
+ *                   a usrVisibleData tag. The message is not copied.
+ * @param extraCount Number of pieces in extra (at most MAX_EXTRA_PIECES)
  *
  * @param signature  The resulting signature. It's allocated and
  *                   is null-terminated.
@@ -294,7 +299,8 @@ static const char signobj_id[] = "bidSignedData";
 static BankIDError sign(Token *token,
                         const char *challenge, int32_t serverTime,
                         const char *hostname, const char *ip,
-                        const char *purpose, const char *extra,
+                        const char *purpose,
+                        const StringPiece *extra, size_t extraCount,
                         char **signature) {
     
     // Create the authentication XML
@@ -308,20 +314,28 @@ static BankIDError sign(Token *token,
                                 serverTime);
     }
     
-    char *object = rasprintf(sign_template, extra, challenge, timeElement,
-                             purpose, hostname, ip, version);
+    char *tail = rasprintf(sign_tail_template, challenge, timeElement,
+                           purpose, hostname, ip, version);
     
     if (serverTime) free(timeElement);
     free(version);
     
-    // Sign
-    char *xmlsig = xmldsig_sign(token, signobj_id, object);
-    free(object);
+    // Sign. The object is passed in pieces, so the message isn't copied.
+    StringPiece object[MAX_EXTRA_PIECES + 2];
+    size_t count = 0;
+    object[count].data = sign_head;
+    object[count++].length = strlen(sign_head);
+    for (size_t i = 0; i < extraCount; i++) {
+        object[count++] = extra[i];
+    }
+    object[count].data = tail;
+    object[count++].length = strlen(tail);
     
-    if (xmlsig) {
-        // Encode with base64
-        *signature = base64_encode(xmlsig, strlen(xmlsig));
-        free(xmlsig);
+    // The result is encoded with base64
+    *signature = xmldsig_sign(token, signobj_id, object, count);
+    free(tail);
+    
+    if (*signature) {
         return BIDERR_OK;
     } else {
         *signature = NULL;
@@ -334,7 +348,7 @@ BankIDError bankid_authenticate(Token *token,
                                 const char *hostname, const char *ip,
                                 char **signature) {
     return sign(token, challenge, serverTime, hostname, ip,
-                "Identification", "", signature);
+                "Identification", NULL, 0, signature);
 }
 
 BankIDError bankid_sign(Token *token,
@@ -344,17 +358,32 @@ BankIDError bankid_sign(Token *token,
                         const char *invisibleMessage,
                         char **signature) {
     BankIDError error;
+    StringPiece extra[MAX_EXTRA_PIECES];
+    size_t count = 0;
+    
+    char *textHead = rasprintf(signedText_head_template, messageEncoding);
+    if (!textHead) return BIDERR_InternalError;
     
-    char *extra = rasprintf(signedText_template, messageEncoding, message);
+    extra[count].data = textHead;
+    extra[count++].length = strlen(textHead);
+    extra[count].data = message;
+    extra[count++].length = strlen(message);
+    extra[count].data = signedText_tail;
+    extra[count++].length = strlen(signedText_tail);
     
     if (invisibleMessage) {
-        extra = rasprintf_append(extra, signedInvisibleText_template, invisibleMessage);
+        extra[count].data = signedInvisibleText_head;
+        extra[count++].length = strlen(signedInvisibleText_head);
+        extra[count].data = invisibleMessage;
+        extra[count++].length = strlen(invisibleMessage);
+        extra[count].data = signedInvisibleText_tail;
+        extra[count++].length = strlen(signedInvisibleText_tail);
     }
     
     error = sign(token, challenge, serverTime, hostname, ip,
-                 "Signing", extra, signature);
+                 "Signing", extra, count, signature);
     
-    free(extra);
+    free(textHead);
     return error;
 }
 
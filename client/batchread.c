@@ -0,0 +1,365 @@
+/*
+
+  Copyright (c) 2026 Samuel Lidén Borell <samuel@kodafritt.se>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+  
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+*/
+
+#define _BSD_SOURCE 1
+#define _POSIX_C_SOURCE 200112
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "../common/defines.h"
+#include "misc.h"
+#include "platform.h"
+
+/*
+  Batched reading of files.
+  
+  On network file systems, each open, read and close is a round trip to
+  the server. When many key files have to be read, the requests for all
+  files are submitted at once with io_uring, so the total time depends on
+  the slowest file rather than on the number of files. This uses the
+  system calls directly, so it doesn't need liburing.
+  
+  The files are not locked (io_uring can't do fcntl locks), so the caller
+  should read a file again with platform_mapFile if the data turns out to
+  be invalid. It can be disabled by setting FRIBID_IO_URING=0.
+*/
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#endif
+
+// IORING_OP_OPENAT, _READ and _CLOSE were added in Linux 5.6, together
+// with this flag
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define HAVE_IO_URING 1
+
+// Number of files that are read at a time
+#define RING_ENTRIES 64
+
+// Result of an entry that hasn't completed. Results are 0 or more, or a
+// negated errno value.
+#define PENDING INT_MIN
+
+typedef struct {
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+} Ring;
+
+static void closeRing(Ring *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing && ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqRing) munmap(ring->sqRing, ring->sqRingSize);
+    if (ring->fd != -1) close(ring->fd);
+}
+
+static bool openRing(Ring *ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    
+    // This fails with ENOSYS or EPERM if io_uring is not available or
+    // has been disabled
+    ring->fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring->fd == -1) return false;
+    
+    // The headers may be newer than the kernel. Older kernels can't open,
+    // read or close files with io_uring.
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) goto error;
+    
+    ring->sqRingSize = params.sq_off.array +
+                       params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes +
+                       params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    
+    // Newer kernels have both rings in the same mapping
+    bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP);
+    if (singleMap && ring->cqRingSize > ring->sqRingSize) {
+        ring->sqRingSize = ring->cqRingSize;
+    }
+    
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        ring->sqRing = NULL;
+        goto error;
+    }
+    
+    if (singleMap) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            ring->cqRing = NULL;
+            goto error;
+        }
+    }
+    
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto error;
+    }
+    
+    char *sq = ring->sqRing, *cq = ring->cqRing;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+    
+  error:
+    closeRing(ring);
+    return false;
+}
+
+/**
+ * Returns a cleared submission queue entry. The ring has room for all
+ * entries of a batch, since batches are at most RING_ENTRIES long.
+ */
+static struct io_uring_sqe *getSqe(Ring *ring, size_t userData) {
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = userData;
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail+1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/**
+ * Returns the number of queued entries that the kernel hasn't taken yet.
+ */
+static unsigned unsubmitted(const Ring *ring) {
+    return *ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Submits the queued entries and waits until the given number of entries
+ * have completed. The result of each entry is stored in
+ * results[user_data].
+ */
+static bool submitAndWait(Ring *ring, unsigned count, int *results) {
+    unsigned completed = 0;
+    while (completed < count) {
+        int ret = (int)syscall(__NR_io_uring_enter, ring->fd,
+                               unsubmitted(ring), 1,
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret == -1 && errno == EINTR) continue;
+        if (ret == -1) return false;
+        
+        unsigned head = *ring->cqHead;
+        unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+            results[cqe->user_data] = cqe->res;
+            head++;
+            completed++;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+/**
+ * Cancels the entries that haven't completed, and waits until they have
+ * stopped. Returns false if that fails. The kernel may then still write
+ * to the buffers of those reads (which still have PENDING as result), or
+ * open those files.
+ */
+static bool cancelReads(Ring *ring, unsigned count, int *results) {
+    // Make room in the submission queue for the cancel requests
+    while (unsubmitted(ring) > 0) {
+        int ret = (int)syscall(__NR_io_uring_enter, ring->fd,
+                               unsubmitted(ring), 0, 0, NULL, 0);
+        if (ret == 0 || (ret == -1 && errno != EINTR)) return false;
+    }
+    
+    unsigned waiting = 0;
+    for (unsigned i = 0; i < count; i++) {
+        if (results[i] != PENDING) continue;
+        struct io_uring_sqe *sqe = getSqe(ring, RING_ENTRIES + i);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = i;  // user_data of the read
+        results[RING_ENTRIES + i] = PENDING;
+        waiting += 2;
+    }
+    
+    // Each read completes (possibly with -ECANCELED), and so does each
+    // cancel request
+    return submitAndWait(ring, waiting, results);
+}
+
+/**
+ * Opens, reads and closes a batch of at most RING_ENTRIES files.
+ */
+static bool readBatch(Ring *ring, PlatformFileRead *reads, unsigned count) {
+    // Reads and their cancel requests (see cancelReads)
+    int results[2*RING_ENTRIES];
+    char *buffers[RING_ENTRIES];
+    int fds[RING_ENTRIES];
+    
+    // Open all files
+    for (unsigned i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe = getSqe(ring, i);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)reads[i].filename;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        results[i] = PENDING;
+    }
+    if (!submitAndWait(ring, count, results)) {
+        cancelReads(ring, count, results);
+        for (unsigned i = 0; i < count; i++) {
+            if (results[i] >= 0) close(results[i]);
+        }
+        return false;
+    }
+    
+    // Read the files that could be opened
+    unsigned reading = 0;
+    for (unsigned i = 0; i < count; i++) {
+        fds[i] = results[i];
+        buffers[i] = NULL;
+        // The length of the result is an int
+        if (fds[i] < 0 || !reads[i].length || reads[i].length > INT_MAX ||
+            !(buffers[i] = malloc(reads[i].length))) continue;
+        
+        struct io_uring_sqe *sqe = getSqe(ring, i);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fds[i];
+        sqe->addr = (unsigned long)buffers[i];
+        sqe->len = (unsigned)reads[i].length;
+        sqe->off = 0;
+        results[i] = PENDING;
+        reading++;
+    }
+    if (!submitAndWait(ring, reading, results)) {
+        // Buffers of reads that might still be in progress are leaked,
+        // since the kernel could write to them after they were freed
+        bool stopped = cancelReads(ring, count, results);
+        for (unsigned i = 0; i < count; i++) {
+            if (buffers[i] && (stopped || results[i] != PENDING)) {
+                guaranteed_memset(buffers[i], 0, reads[i].length);
+                free(buffers[i]);
+            }
+            if (fds[i] >= 0) close(fds[i]);
+        }
+        return false;
+    }
+    
+    // Close the files. This is also a round trip on some file systems
+    unsigned closing = 0;
+    int closeResults[RING_ENTRIES];
+    for (unsigned i = 0; i < count; i++) {
+        if (fds[i] < 0) continue;
+        struct io_uring_sqe *sqe = getSqe(ring, i);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fds[i];
+        closing++;
+    }
+    bool ok = submitAndWait(ring, closing, closeResults);
+    
+    for (unsigned i = 0; i < count; i++) {
+        if (!buffers[i]) continue;
+        
+        // A short read means that the file has changed since it was
+        // listed. It's read again with platform_mapFile then
+        if (results[i] == (int)reads[i].length) {
+            reads[i].file.data = buffers[i];
+            reads[i].file.length = reads[i].length;
+            reads[i].file.mapped = false;
+            reads[i].ok = true;
+        } else {
+            guaranteed_memset(buffers[i], 0, reads[i].length);
+            free(buffers[i]);
+        }
+    }
+    return ok;
+}
+#endif
+
+/**
+ * Reads a number of files at once, with io_uring. The length of each file
+ * must be known in advance (from stat), and files that have a different
+ * length, or that are larger than INT_MAX, are not read. The caller should
+ * only pass regular files of a sane size, since each one is read into an
+ * allocated buffer. The data of each file that was read must be freed
+ * with platform_unmapFile.
+ *
+ * Returns false if batched reading is not available. The files that were
+ * not read (with ok set to false) should be read in some other way.
+ */
+bool platform_readFiles(PlatformFileRead *reads, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        reads[i].ok = false;
+        memset(&reads[i].file, 0, sizeof(PlatformFile));
+        reads[i].file.fd = -1;
+    }
+    
+#if HAVE_IO_URING
+    const char *enabled = getenv("FRIBID_IO_URING");
+    if (enabled && atoi(enabled) == 0) return false;
+    
+    Ring ring;
+    if (!openRing(&ring)) return false;
+    
+    bool ok = true;
+    for (size_t i = 0; ok && i < count; i += RING_ENTRIES) {
+        size_t batchCount = count - i;
+        if (batchCount > RING_ENTRIES) batchCount = RING_ENTRIES;
+        ok = readBatch(&ring, &reads[i], (unsigned)batchCount);
+    }
+    
+    closeRing(&ring);
+    return ok;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,94 @@
+/*
+
+  Copyright (c) 2026 Samuel Lidén Borell <samuel@kodafritt.se>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+  
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+*/
+
+#define _POSIX_C_SOURCE 200112
+#include <stdbool.h>
+#include <time.h>
+
+#include "cancel.h"
+
+/*
+  Cooperative cancellation of requests.
+  
+  A request is cancelled when its deadline has passed, or when the poll
+  function says so (the plugin has sent PC_Cancel or closed the pipe).
+  Slow operations check cancel_isRequested at suitable points and give
+  up with TokenError_Cancelled.
+*/
+
+static CancelPollFunction pollFunction = NULL;
+static bool active = false;
+static bool requested = false;
+static bool hasDeadline = false;
+static struct timespec deadline;
+
+/**
+ * Sets the function that checks if the other side wants to cancel the
+ * current request. It must not block.
+ */
+void cancel_setPollFunction(CancelPollFunction function) {
+    pollFunction = function;
+}
+
+/**
+ * Called when a request is started. The request is cancelled after the
+ * given number of seconds, unless it's zero.
+ */
+void cancel_start(int timeout) {
+    active = true;
+    requested = false;
+    hasDeadline = (timeout > 0 &&
+                   clock_gettime(CLOCK_MONOTONIC, &deadline) == 0);
+    if (hasDeadline) deadline.tv_sec += timeout;
+}
+
+void cancel_end(void) {
+    active = false;
+    requested = false;
+    hasDeadline = false;
+}
+
+/**
+ * Returns true if the current request should be aborted.
+ */
+bool cancel_isRequested(void) {
+    if (!active || requested) return requested;
+    
+    if (hasDeadline) {
+        struct timespec now;
+        if (clock_gettime(CLOCK_MONOTONIC, &now) == 0 &&
+            (now.tv_sec > deadline.tv_sec ||
+             (now.tv_sec == deadline.tv_sec &&
+              now.tv_nsec >= deadline.tv_nsec))) {
+            requested = true;
+        }
+    }
+    
+    if (!requested && pollFunction && pollFunction()) {
+        requested = true;
+    }
+    return requested;
+}
+
+
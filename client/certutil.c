@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <glib.h>
 #include <openssl/asn1t.h>
+#include <openssl/crypto.h>
 #include <openssl/err.h>
 
 #include "../common/defines.h"
@@ -39,6 +40,35 @@
 
 
 static char *error_string = NULL;
+static char error_buffer[256];
+G_LOCK_DEFINE_STATIC(error_string);
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static GMutex *openssl_locks = NULL;
+
+static void lockingCallback(int mode, int n, const char *file, int line) {
+    if (mode & CRYPTO_LOCK) g_mutex_lock(&openssl_locks[n]);
+    else g_mutex_unlock(&openssl_locks[n]);
+}
+#endif
+
+/**
+ * Sets up locking in OpenSSL, so it can be used from several threads (key
+ * files are parsed in a thread pool, see keystore.c). OpenSSL 1.1 and
+ * later does this by itself.
+ */
+void certutil_initThreads() {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    if (openssl_locks || CRYPTO_get_locking_callback()) return;
+    
+    int count = CRYPTO_num_locks();
+    openssl_locks = g_new(GMutex, count);
+    for (int i = 0; i < count; i++) {
+        g_mutex_init(&openssl_locks[i]);
+    }
+    CRYPTO_set_locking_callback(lockingCallback);
+#endif
+}
 
 typedef struct {
     const char *name;
@@ -426,8 +456,11 @@ void certutil_updateErrorString() {
 #if ENABLE_PKCS11
     ERR_load_PKCS11_strings();
 #endif
-    error_string = ERR_error_string(ERR_get_error(), NULL);
+    G_LOCK(error_string);
+    ERR_error_string_n(ERR_get_error(), error_buffer, sizeof(error_buffer));
+    error_string = error_buffer;
     fprintf(stderr, BINNAME ": error from OpenSSL or libP11: %s\n", error_string);
+    G_UNLOCK(error_string);
 }
 
 char *certutil_getErrorString() {
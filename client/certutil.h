@@ -52,6 +52,7 @@ void certutil_freeList(char ***list, size_t *count);
 PKCS7 *certutil_parseP7SignedData(const char *p7data, size_t length);
 char *certutil_makeFilename(X509_NAME *xname);
 char *certutil_getBagAttr(PKCS12_SAFEBAG *bag, ASN1_OBJECT *oid);
+void certutil_initThreads();
 void certutil_clearErrorString();
 void certutil_updateErrorString();
 char *certutil_getErrorString();
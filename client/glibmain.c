@@ -0,0 +1,382 @@
+/*
+
+  Copyright (c) 2009-2011, 2026 Samuel Lidén Borell <samuel@kodafritt.se>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+  
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+*/
+
+#define _BSD_SOURCE 1
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // For STDIN_FILENO
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <locale.h>
+#include <libintl.h>
+
+#include <glib.h>
+#include <gmodule.h>
+
+#include "../common/defines.h"
+#include "../common/trace.h"
+#include "misc.h"
+#include "platform.h"
+
+/*
+  Main loop and loading of the user interface module.
+  
+  The signer only uses GLib until a dialog is shown. The dialogs are in a
+  separate module (gtk.c), which is loaded and initialized by the first
+  call to a dialog function. Commands that don't show any dialog, such as
+  GetVersion, don't have to load GTK at all.
+*/
+
+static GMainLoop *mainLoop = NULL;
+
+void platform_init(int *argc, char ***argv) {
+    setlocale(LC_ALL, "");
+    bindtextdomain(BINNAME, LOCALEDIR);
+    textdomain(BINNAME);
+}
+
+void platform_leaveMainloop() {
+    if (mainLoop) g_main_loop_quit(mainLoop);
+}
+
+static PlatformPipeFunction* currentPipeFunction = NULL;
+
+static gboolean pipeCallback(GIOChannel *source,
+                             GIOCondition condition, gpointer data) {
+    currentPipeFunction();
+    return TRUE;
+}
+
+void platform_setupPipe(PlatformPipeFunction *pipeFunction) {
+    assert(currentPipeFunction == NULL);
+    currentPipeFunction = pipeFunction;
+    
+    GIOChannel *stdinChannel = g_io_channel_unix_new(STDIN_FILENO);
+    g_io_add_watch(stdinChannel,
+                   G_IO_IN | G_IO_HUP | G_IO_ERR, pipeCallback, NULL);
+    g_io_channel_unref(stdinChannel);
+}
+
+// Second watch of stdin, while a dialog is shown
+static guint dialogPipeWatch = 0;
+static int dialogPipeWatchCount = 0;
+
+static gboolean dialogPipeCallback(GIOChannel *source,
+                                   GIOCondition condition, gpointer data) {
+    currentPipeFunction();
+    
+    // The end of the stream stays readable, so stop watching it
+    if (condition & (G_IO_HUP | G_IO_ERR)) {
+        dialogPipeWatch = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Watches stdin while a dialog is shown, so requests from other plugin
+ * objects are served immediately. Dialogs are run from inside the callback
+ * of the watch from platform_setupPipe, and GLib doesn't dispatch a source
+ * again until its callback has returned. Calls may be nested.
+ */
+void platform_watchPipe() {
+    if (dialogPipeWatchCount++ > 0 || !currentPipeFunction) return;
+    
+    GIOChannel *stdinChannel = g_io_channel_unix_new(STDIN_FILENO);
+    dialogPipeWatch = g_io_add_watch(stdinChannel,
+                                     G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                     dialogPipeCallback, NULL);
+    g_io_channel_unref(stdinChannel);
+}
+
+void platform_unwatchPipe() {
+    if (--dialogPipeWatchCount > 0) return;
+    
+    if (dialogPipeWatch) g_source_remove(dialogPipeWatch);
+    dialogPipeWatch = 0;
+}
+
+#ifdef __linux__
+#define KEYDIR_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+                       IN_DELETE)
+
+// inotify watch of the key directories, while a dialog is shown
+static struct {
+    PlatformKeyFileFunction *function;
+    int fd;
+    guint source;
+    size_t count;
+    int *wds;
+    char **paths;
+} keyDirWatch = { .fd = -1 };
+
+static gboolean keyDirCallback(GIOChannel *source,
+                               GIOCondition condition, gpointer data) {
+    char buffer[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    
+    ssize_t length = read(keyDirWatch.fd, buffer, sizeof(buffer));
+    if (length == -1 && (errno == EAGAIN || errno == EINTR)) return TRUE;
+    if (length <= 0) {
+        // The descriptor is broken, so stop watching it
+        keyDirWatch.source = 0;
+        return FALSE;
+    }
+    
+    const char *p = buffer;
+    while (p < buffer + length) {
+        const struct inotify_event *event = (const struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + event->len;
+        
+        if (event->mask & IN_Q_OVERFLOW) {
+            // Events have been lost, so check all files
+            keyDirWatch.function(NULL);
+            continue;
+        }
+        if (!event->len) continue;
+        
+        for (size_t i = 0; i < keyDirWatch.count; i++) {
+            if (keyDirWatch.wds[i] != event->wd) continue;
+            
+            // Same format as platform_currentPath, since the path is
+            // compared with the tag of the tokens
+            char *filename = rasprintf("%s/%s", keyDirWatch.paths[i],
+                                       event->name);
+            if (filename) keyDirWatch.function(filename);
+            free(filename);
+            break;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * Calls a function with the path of each key file that is created,
+ * changed or removed in the key directories, until platform_unwatchKeyDirs
+ * is called. If some changes have been lost, then it's called with NULL
+ * instead. Directories that don't exist are not watched. Returns false
+ * if the directories can't be watched.
+ */
+bool platform_watchKeyDirs(PlatformKeyFileFunction *function) {
+    platform_unwatchKeyDirs();
+    
+    keyDirWatch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (keyDirWatch.fd == -1) return false;
+    
+    char **paths;
+    size_t len;
+    platform_keyDirs(&paths, &len);
+    keyDirWatch.wds = malloc((len+1) * sizeof(int));
+    keyDirWatch.paths = malloc((len+1) * sizeof(char*));
+    for (size_t i = 0; i <= len; i++) {
+        int wd = (keyDirWatch.wds && keyDirWatch.paths ?
+            inotify_add_watch(keyDirWatch.fd, paths[i], KEYDIR_EVENTS) : -1);
+        if (wd != -1) {
+            keyDirWatch.wds[keyDirWatch.count] = wd;
+            keyDirWatch.paths[keyDirWatch.count++] = paths[i];
+        } else {
+            free(paths[i]);
+        }
+    }
+    
+    if (!keyDirWatch.count) {
+        platform_unwatchKeyDirs();
+        return false;
+    }
+    
+    keyDirWatch.function = function;
+    GIOChannel *channel = g_io_channel_unix_new(keyDirWatch.fd);
+    keyDirWatch.source = g_io_add_watch(channel, G_IO_IN,
+                                        keyDirCallback, NULL);
+    g_io_channel_unref(channel);
+    return true;
+}
+
+void platform_unwatchKeyDirs() {
+    if (keyDirWatch.source) g_source_remove(keyDirWatch.source);
+    if (keyDirWatch.fd != -1) close(keyDirWatch.fd);
+    for (size_t i = 0; i < keyDirWatch.count; i++) {
+        free(keyDirWatch.paths[i]);
+    }
+    free(keyDirWatch.paths);
+    free(keyDirWatch.wds);
+    memset(&keyDirWatch, 0, sizeof(keyDirWatch));
+    keyDirWatch.fd = -1;
+}
+#else
+bool platform_watchKeyDirs(PlatformKeyFileFunction *function) {
+    return false;
+}
+
+void platform_unwatchKeyDirs() {
+}
+#endif
+
+void platform_mainloop() {
+    mainLoop = g_main_loop_new(NULL, FALSE);
+    g_main_loop_run(mainLoop);
+    g_main_loop_unref(mainLoop);
+    mainLoop = NULL;
+}
+
+/**
+ * Returns the filename of the user interface module. This can be
+ * overridden with FRIBID_UI_MODULE.
+ */
+static const char *getModuleFilename() {
+    const char *filename = getenv("FRIBID_UI_MODULE");
+    return (filename ? filename : UI_GTK_MODULE);
+}
+
+/**
+ * Loads and initializes the user interface module, the first time it's
+ * called. Returns NULL if it couldn't be loaded.
+ */
+static const PlatformUI *getUI() {
+    static bool loaded = false;
+    static const PlatformUI *ui = NULL;
+    
+    if (loaded) return ui;
+    loaded = true;
+    
+    int64_t traceStart = trace_begin();
+    GModule *module = g_module_open(getModuleFilename(),
+                                    G_MODULE_BIND_LAZY | G_MODULE_BIND_LOCAL);
+    if (!module) {
+        fprintf(stderr, BINNAME ": failed to load the user interface: %s\n",
+                g_module_error());
+        return NULL;
+    }
+    
+    PlatformUIInitFunction *initFunction;
+    if (!g_module_symbol(module, PLATFORM_UI_ENTRY,
+                         (gpointer *)&initFunction)) {
+        fprintf(stderr, BINNAME ": invalid user interface module: %s\n",
+                g_module_error());
+        g_module_close(module);
+        return NULL;
+    }
+    
+    // GTK can't be unloaded
+    g_module_make_resident(module);
+    ui = initFunction();
+    trace_end("load user interface", traceStart);
+    return ui;
+}
+
+/**
+ * Loads the user interface module, and returns false if that fails. This
+ * is checked before a dialog is shown, since the dialog functions can't
+ * tell a broken installation apart from the user pressing Cancel.
+ */
+bool platform_hasUI() {
+    return (getUI() != NULL);
+}
+
+/* Signature dialog */
+void platform_startSign(const char *url, const char *hostname, const char *ip,
+                        unsigned long parentWindowId) {
+    const PlatformUI *ui = getUI();
+    if (ui) ui->startSign(url, hostname, ip, parentWindowId);
+}
+
+void platform_endSign() {
+    const PlatformUI *ui = getUI();
+    if (ui) ui->endSign();
+}
+
+void platform_setNotifier(BackendNotifier *notifier) {
+    const PlatformUI *ui = getUI();
+    if (ui) ui->setNotifier(notifier);
+}
+
+void platform_setMessage(const char *message) {
+    const PlatformUI *ui = getUI();
+    if (ui) ui->setMessage(message);
+}
+
+void platform_addToken(Token *token) {
+    const PlatformUI *ui = getUI();
+    if (ui) ui->addToken(token);
+}
+
+void platform_removeToken(Token *token) {
+    const PlatformUI *ui = getUI();
+    if (ui) ui->removeToken(token);
+}
+
+void platform_updateToken(Token *token) {
+    const PlatformUI *ui = getUI();
+    if (ui) ui->updateToken(token);
+}
+
+/**
+ * Shows the signature dialog. Returns false if the user cancelled, and
+ * also if no dialog can be shown.
+ */
+bool platform_sign(Token **token, char *password, int password_maxlen) {
+    const PlatformUI *ui = getUI();
+    return (ui ? ui->sign(token, password, password_maxlen) : false);
+}
+
+/* Password selection (and key generation) dialog */
+void platform_startChoosePassword(const char *name,
+                                  unsigned long parentWindowId) {
+    const PlatformUI *ui = getUI();
+    if (ui) ui->startChoosePassword(name, parentWindowId);
+}
+
+void platform_setPasswordPolicy(int minLength, int minNonDigits,
+                                int minDigits) {
+    const PlatformUI *ui = getUI();
+    if (ui) ui->setPasswordPolicy(minLength, minNonDigits, minDigits);
+}
+
+void platform_endChoosePassword() {
+    const PlatformUI *ui = getUI();
+    if (ui) ui->endChoosePassword();
+}
+
+bool platform_choosePassword(char *password, long password_maxlen) {
+    const PlatformUI *ui = getUI();
+    return (ui ? ui->choosePassword(password, password_maxlen) : false);
+}
+
+/* Errors */
+void platform_showError(TokenError error) {
+    const PlatformUI *ui = getUI();
+    if (ui) ui->showError(error);
+}
+
+void platform_versionExpiredError() {
+    const PlatformUI *ui = getUI();
+    if (ui) ui->versionExpiredError();
+}
+
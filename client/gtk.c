@@ -32,14 +32,13 @@
 #include <assert.h>
 #include <errno.h>
 
-#include <locale.h>
 #include <libintl.h>
 
-#include <unistd.h> // For STDIN_FILENO
-
 #include "../common/defines.h"
 #include "backend.h"
 #include "bankid.h"
+#include "cancel.h"
+#include "keystore.h"
 #include "platform.h"
 #include "misc.h"
 #include "certutil.h"
@@ -78,42 +77,11 @@ static const char *const errorStrings[] = {
     // Key generation errors
     //TokenError_NoRandomState,
     translatable("No random state available (/dev/(u)random must exist)"),
-};
-
-
-void platform_init(int *argc, char ***argv) {
-    setlocale(LC_ALL, "");
-    bindtextdomain(BINNAME, LOCALEDIR);
-    textdomain(BINNAME);
     
-    gtk_init(argc, argv);
-}
-
-void platform_leaveMainloop() {
-    gtk_main_quit();
-}
-
-static PlatformPipeFunction* currentPipeFunction = NULL;
-
-static gboolean pipeCallback(GIOChannel *source,
-                             GIOCondition condition, gpointer data) {
-    currentPipeFunction();
-    return TRUE;
-}
-
-void platform_setupPipe(PlatformPipeFunction *pipeFunction) {
-    assert(currentPipeFunction == NULL);
-    currentPipeFunction = pipeFunction;
-    
-    GIOChannel *stdinChannel = g_io_channel_unix_new(STDIN_FILENO);
-    g_io_add_watch(stdinChannel,
-                   G_IO_IN | G_IO_HUP | G_IO_ERR, pipeCallback, NULL);
-    g_io_channel_unref(stdinChannel);
-}
+    // TokenError_Cancelled
+    translatable("The operation was cancelled"),
+};
 
-void platform_mainloop() {
-    gtk_main();
-}
 
 /* Sign/Authenticate dialog controls and state */
 static GtkDialog *signDialog;
@@ -145,6 +113,9 @@ static bool keygenDialogShown;
 
 static GtkDialog *activeDialog;
 
+static void setMessage(const char *message);
+static void showError(TokenError error);
+
 /**
  * Makes a dialog window stay above it's parent window.
  */
@@ -176,11 +147,36 @@ static void makeDialogTransient(GtkDialog *dialog, unsigned long parentWindowId)
     }
 }
 
+// Milliseconds between checks for cancellation while a dialog is shown.
+// Requests from the plugin are read by the pipe watch, so this only
+// matters for the deadline.
+#define CANCEL_CHECK_INTERVAL 250
+
+static gboolean checkCancel(gpointer dialog) {
+    if (cancel_isRequested()) {
+        gtk_dialog_response(GTK_DIALOG(dialog), GTK_RESPONSE_CANCEL);
+    }
+    return TRUE;
+}
+
+/**
+ * Runs a dialog, which is closed if the request is cancelled. Quick
+ * commands from other plugin objects are served while it's shown.
+ */
+static gint runDialog(GtkDialog *dialog) {
+    platform_watchPipe();
+    guint timer = g_timeout_add(CANCEL_CHECK_INTERVAL, checkCancel, dialog);
+    gint response = gtk_dialog_run(dialog);
+    g_source_remove(timer);
+    platform_unwatchPipe();
+    return response;
+}
+
 static void showMessage(GtkMessageType type, const char *text) {
     GtkWidget *dialog = gtk_message_dialog_new(
         GTK_WINDOW(activeDialog), GTK_DIALOG_DESTROY_WITH_PARENT,
         type, GTK_BUTTONS_CLOSE, "%s", text);
-    gtk_dialog_run(GTK_DIALOG(dialog));
+    runDialog(GTK_DIALOG(dialog));
     gtk_widget_destroy(dialog);
 }
 
@@ -216,22 +212,6 @@ static void validateDialog(GtkWidget *ignored1, gpointer *ignored2) {
     }
 }
 
-static TokenError addTokenFile(const char *filename) {
-    int fileLen;
-    char *fileData;
-    
-    if (!platform_readFile(filename, &fileData, &fileLen))
-        return TokenError_FileNotReadable;
-    
-    TokenError error = backend_addFile(notifier, fileData, fileLen,
-                                       strdup(filename));
-    
-    guaranteed_memset(fileData, 0, fileLen);
-    free(fileData);
-    
-    return error;
-}
-
 /**
  * Tells the backend to remove a file token.
  */
@@ -273,8 +253,8 @@ static void selectDefaultToken() {
     }
 }
 
-void platform_startSign(const char *url, const char *hostname, const char *ip,
-                        unsigned long parentWindowId) {
+static void startSign(const char *url, const char *hostname, const char *ip,
+                      unsigned long parentWindowId) {
     
     GtkBuilder *builder = gtk_builder_new();
     GError *error = NULL;
@@ -334,14 +314,14 @@ void platform_startSign(const char *url, const char *hostname, const char *ip,
     
     makeDialogTransient(signDialog, parentWindowId);
     
-    platform_setMessage(NULL);
+    setMessage(NULL);
     validateDialog(NULL, NULL);
     
     gtk_window_set_modal(GTK_WINDOW(signDialog), TRUE);
     signDialogShown = false;
 }
 
-void platform_endSign() {
+static void endSign() {
     // Remove all manually added tokens
     GtkTreeModel *model = GTK_TREE_MODEL(tokens);
     GtkTreeIter iter = { .stamp = 0 };
@@ -365,7 +345,7 @@ void platform_endSign() {
     g_object_unref(tokens);
 }
 
-void platform_setMessage(const char *message) {
+static void setMessage(const char *message) {
     if (message == NULL) {
         gtk_widget_hide(signLabel);
         gtk_widget_hide(signScroller);
@@ -390,37 +370,10 @@ void platform_setMessage(const char *message) {
  * Sets the backend notifier to use for receiving token insertion/removal
  * events and manually requesting token files to be added.
  */
-void platform_setNotifier(BackendNotifier *notifierToUse) {
+static void setNotifier(BackendNotifier *notifierToUse) {
     notifier = notifierToUse;
 }
 
-/**
- * Add  from the key directories
- */
-void platform_addKeyDirectories() {
-    char** paths;
-    size_t len;
-    
-    // Look for P12s in ~/cbt and ~/.cbt
-    platform_keyDirs(&paths, &len);
-    for (size_t i = 0; i <= len; i++) {
-        PlatformDirIter *dir = platform_openKeysDir(paths[i]);
-        if (dir) {
-            while (platform_iterateDir(dir)) {
-                char *filename = platform_currentPath(dir);
-                
-                if (!strstr(filename, ".tmp")) {
-                    addTokenFile(filename);
-                }
-                
-                free(filename);
-            }
-            platform_closeDir(dir);
-        }
-        free(paths[i]);
-    }
-}
-
 static gboolean addTokenFunc(gpointer ptr) {
     Token *token = (Token*)ptr;
     GtkTreeIter iter = { .stamp = 0 };
@@ -429,7 +382,7 @@ static gboolean addTokenFunc(gpointer ptr) {
     // Check for errors
     TokenError error = token_getLastError(token);
     if (error) {
-        platform_showError(error);
+        showError(error);
         return FALSE;
     }
     
@@ -466,22 +419,51 @@ static gboolean removeTokenFunc(gpointer ptr) {
     return FALSE;
 }
 
+static gboolean updateTokenFunc(gpointer ptr) {
+    Token *token = (Token*)ptr;
+    GtkTreeModel *model = GTK_TREE_MODEL(tokens);
+    GtkTreeIter iter = { .stamp = 0 };
+    
+    bool valid = gtk_tree_model_get_iter_first(model, &iter);
+    while (valid) {
+        Token *listToken;
+        gtk_tree_model_get(model, &iter,
+                           1, &listToken, -1);
+        if (listToken == token) {
+            gtk_list_store_set(tokens, &iter,
+                               0, token_getDisplayName(token), -1);
+            break;
+        }
+        valid = gtk_tree_model_iter_next(model, &iter);
+    }
+    
+    return FALSE;
+}
+
 /**
  * Adds a token to the list of identity tokens. This function should be called
- * after platform_startSign.
+ * after startSign.
  */
-void platform_addToken(Token *token) {
+static void addToken(Token *token) {
     g_idle_add_full(G_PRIORITY_HIGH, addTokenFunc, token, NULL);
 }
 
 /**
  * Removes a token from the list of identity tokens. This function should only
- * be called after platform_startSign has been called.
+ * be called after startSign has been called.
  */
-void platform_removeToken(Token *token) {
+static void removeToken(Token *token) {
     g_idle_add_full(G_PRIORITY_HIGH, removeTokenFunc, token, NULL);
 }
 
+/**
+ * Updates a token in the list of identity tokens, for example when the key
+ * file has been changed. The token stays selected if it was selected.
+ */
+static void updateToken(Token *token) {
+    g_idle_add_full(G_PRIORITY_HIGH, updateTokenFunc, token, NULL);
+}
+
 
 static void selectExternalFile() {
     TokenError error = TokenError_Success;
@@ -493,17 +475,17 @@ static void selectExternalFile() {
             (char *)NULL));
     activeDialog = GTK_DIALOG(chooser);
     
-    while (gtk_dialog_run(GTK_DIALOG(chooser)) == GTK_RESPONSE_ACCEPT) {
+    while (runDialog(GTK_DIALOG(chooser)) == GTK_RESPONSE_ACCEPT) {
         gchar *filename = gtk_file_chooser_get_filename(chooser);
         
         removeTokenFile(filename);
         
         // Add an item to the token list and select it
         certutil_clearErrorString();
-        error = addTokenFile(filename);
+        error = keystore_addFile(notifier, filename);
         
         g_free(filename);
-        if (error) platform_showError(error);
+        if (error) showError(error);
         else break;
     }
     
@@ -519,7 +501,7 @@ static void selectExternalFile() {
  * Waits for the user to fill in the dialog, and loads the P12 file for
  * the selected subject.
  */
-bool platform_sign(Token **token, char *password, int password_maxlen) {
+static bool sign(Token **token, char *password, int password_maxlen) {
     guint response;
     certutil_clearErrorString();
 
@@ -533,7 +515,7 @@ bool platform_sign(Token **token, char *password, int password_maxlen) {
         signDialogShown = true;
     }
     
-    while ((response = gtk_dialog_run(signDialog)) == RESPONSE_EXTERNAL) {
+    while ((response = runDialog(signDialog)) == RESPONSE_EXTERNAL) {
         // User pressed "External file..."
         selectExternalFile();
     }
@@ -561,7 +543,7 @@ bool platform_sign(Token **token, char *password, int password_maxlen) {
 }
 
 
-void platform_startChoosePassword(const char *name, unsigned long parentWindowId) {
+static void startChoosePassword(const char *name, unsigned long parentWindowId) {
     
     GtkBuilder *builder = gtk_builder_new();
     GError *error = NULL;
@@ -586,13 +568,13 @@ void platform_startChoosePassword(const char *name, unsigned long parentWindowId
     keygenDialogShown = false;
 }
 
-void platform_setPasswordPolicy(int minLength, int minNonDigits, int minDigits) {
+static void setPasswordPolicy(int minLength, int minNonDigits, int minDigits) {
     keygenPasswordMinLen = minLength;
     keygenPasswordMinNonDigits = minNonDigits;
     keygenPasswordMinDigits = minDigits;
 }
 
-void platform_endChoosePassword() {
+static void endChoosePassword() {
     gtk_widget_destroy(GTK_WIDGET(keygenDialog));
     
 }
@@ -607,7 +589,7 @@ static bool weakPassword(int length, int minimum, const char *format) {
     return FALSE;
 }
 
-bool platform_choosePassword(char *password, long password_maxlen) {
+static bool choosePassword(char *password, long password_maxlen) {
     // Restrict the password to the length of the preallocated
     // password buffer
     gtk_entry_set_max_length(keygenPasswordEntry, password_maxlen-1);
@@ -619,7 +601,7 @@ bool platform_choosePassword(char *password, long password_maxlen) {
     }
     
     for (;;) {
-        gint response = gtk_dialog_run(keygenDialog);
+        gint response = runDialog(keygenDialog);
         
         if (response == GTK_RESPONSE_OK) {
             // Check if the passwords match
@@ -676,7 +658,7 @@ bool platform_choosePassword(char *password, long password_maxlen) {
 }
 
 
-void platform_showError(TokenError error) {
+static void showError(TokenError error) {
     assert(error != TokenError_Success);
     
     int lastErrno = errno;
@@ -702,7 +684,7 @@ void platform_showError(TokenError error) {
     }
 }
 
-void platform_versionExpiredError() {
+static void versionExpiredError() {
     showMessage(GTK_MESSAGE_ERROR, _("This software version has expired, and "
                 "will probably not be accepted on all web sites.\n"
                 "\n"
@@ -711,3 +693,33 @@ void platform_versionExpiredError() {
 }
 
 
+/**
+ * Initializes GTK and returns the dialog functions. This is the entry point
+ * of the module, and is called when the first dialog is shown (see
+ * glibmain.c).
+ */
+const PlatformUI *platform_initUI() {
+    static const PlatformUI ui = {
+        startSign,
+        endSign,
+        setNotifier,
+        setMessage,
+        addToken,
+        removeToken,
+        updateToken,
+        sign,
+        startChoosePassword,
+        setPasswordPolicy,
+        endChoosePassword,
+        choosePassword,
+        showError,
+        versionExpiredError,
+    };
+    
+    if (!gtk_init_check(NULL, NULL)) {
+        fprintf(stderr, BINNAME ": failed to initialize GTK\n");
+        return NULL;
+    }
+    return &ui;
+}
+
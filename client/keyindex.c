@@ -0,0 +1,293 @@
+/*
+
+  Copyright (c) 2026 Samuel Lidén Borell <samuel@kodafritt.se>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+  
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+*/
+
+#define _BSD_SOURCE 1
+#define _POSIX_C_SOURCE 200112
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "../common/defines.h"
+#include "keyindex.h"
+#include "misc.h"
+
+/*
+  Index of the key files
+  
+  The certificates in the key files in the key directories are stored in
+  ~/.cache/fribid/keyindex, so unchanged files don't have to be read and
+  parsed each time the tokens are listed. Files are identified by their
+  path, inode, size, and modification and status change times in
+  nanoseconds. The ctime also changes when a file is replaced with one
+  that has the same mtime. The key file is only read when a token is used
+  (see pkcs12.c).
+  
+  The index is a GKeyFile with one group per file:
+  
+      [/home/user/cbt/example.p12]
+      inode=1234
+      size=4567
+      mtime=1300000000123456789
+      ctime=1300000000123456789
+      certs=1
+      subject0=<Base64 of the DER encoded subject name>
+      usages0=4
+      serialNumber0=197001011234
+  
+  It can be disabled by setting FRIBID_KEY_INDEX=0.
+*/
+
+#define INDEX_FILENAME "keyindex"
+#define INDEX_GROUP "fribid"
+#define INDEX_VERSION 2
+
+struct KeyIndex {
+    char *path;
+    char *filename;
+    GKeyFile *keyfile;
+    GHashTable *seen;
+    bool changed;
+};
+
+static bool indexEnabled() {
+    const char *value = getenv("FRIBID_KEY_INDEX");
+    return (!value || atoi(value) != 0);
+}
+
+/**
+ * Loads the key index. Returns NULL if it's disabled.
+ */
+KeyIndex *keyindex_load() {
+    if (!indexEnabled()) return NULL;
+    
+    KeyIndex *index = malloc(sizeof(KeyIndex));
+    if (!index) return NULL;
+    
+    index->path = rasprintf("%s/%s", g_get_user_cache_dir(), BINNAME);
+    index->filename = rasprintf("%s/%s", index->path, INDEX_FILENAME);
+    index->keyfile = g_key_file_new();
+    index->seen = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    index->changed = false;
+    
+    // Start over if the index is missing or has an unknown format
+    if (!g_key_file_load_from_file(index->keyfile, index->filename,
+                                   G_KEY_FILE_NONE, NULL) ||
+        g_key_file_get_integer(index->keyfile, INDEX_GROUP,
+                               "version", NULL) != INDEX_VERSION) {
+        g_key_file_free(index->keyfile);
+        index->keyfile = g_key_file_new();
+        g_key_file_set_integer(index->keyfile, INDEX_GROUP, "version",
+                               INDEX_VERSION);
+        index->changed = true;
+    }
+    return index;
+}
+
+static gint64 getNanoseconds(const struct timespec *time) {
+    return (gint64)time->tv_sec * 1000000000 + time->tv_nsec;
+}
+
+static char *getCertString(GKeyFile *keyfile, const char *group,
+                           const char *name, size_t i) {
+    char key[32];
+    snprintf(key, sizeof(key), "%s%zu", name, i);
+    return g_key_file_get_string(keyfile, group, key, NULL);
+}
+
+static void setCertString(GKeyFile *keyfile, const char *group,
+                          const char *name, size_t i, const char *value) {
+    char key[32];
+    snprintf(key, sizeof(key), "%s%zu", name, i);
+    if (value) g_key_file_set_string(keyfile, group, key, value);
+}
+
+/**
+ * Strings from GKeyFile are allocated with g_malloc. This returns a copy
+ * that can be freed with free().
+ */
+static char *takeString(char *gstr) {
+    char *str = (gstr ? strdup(gstr) : NULL);
+    g_free(gstr);
+    return str;
+}
+
+/**
+ * Looks up a file in the index. Returns false if it's not in the index or
+ * if it has changed.
+ */
+bool keyindex_lookup(KeyIndex *index, const char *filename,
+                     const struct stat *st, KeyIndexEntry *entry) {
+    GKeyFile *keyfile = index->keyfile;
+    entry->certCount = 0;
+    entry->certs = NULL;
+    
+    g_hash_table_insert(index->seen, strdup(filename), NULL);
+    if (!g_key_file_has_group(keyfile, filename) ||
+        g_key_file_get_int64(keyfile, filename, "inode", NULL) !=
+            (gint64)st->st_ino ||
+        g_key_file_get_int64(keyfile, filename, "size", NULL) !=
+            (gint64)st->st_size ||
+        g_key_file_get_int64(keyfile, filename, "mtime", NULL) !=
+            getNanoseconds(&st->st_mtim) ||
+        g_key_file_get_int64(keyfile, filename, "ctime", NULL) !=
+            getNanoseconds(&st->st_ctim)) {
+        return false;
+    }
+    
+    int count = g_key_file_get_integer(keyfile, filename, "certs", NULL);
+    for (size_t i = 0; count > 0 && i < (size_t)count; i++) {
+        KeyIndexCert *cert = keyindex_addCert(entry);
+        if (!cert) break;
+        
+        char *subject = getCertString(keyfile, filename, "subject", i);
+        cert->subject = (subject ?
+            base64_decode_binary(subject, &cert->subjectLength) : NULL);
+        g_free(subject);
+        
+        char key[32];
+        snprintf(key, sizeof(key), "usages%zu", i);
+        cert->usages = (unsigned int)g_key_file_get_integer(keyfile, filename,
+                                                            key, NULL);
+        cert->serialNumber = takeString(
+            getCertString(keyfile, filename, "serialNumber", i));
+        
+        if (!cert->subject) {
+            // Corrupt entry. Parse the file again
+            keyindex_freeEntry(entry);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Adds or replaces a file in the index.
+ */
+void keyindex_store(KeyIndex *index, const char *filename,
+                    const struct stat *st, const KeyIndexEntry *entry) {
+    GKeyFile *keyfile = index->keyfile;
+    
+    // Group names can't contain brackets or line breaks
+    if (strpbrk(filename, "[]\n\r")) return;
+    
+    g_key_file_remove_group(keyfile, filename, NULL);
+    g_key_file_set_int64(keyfile, filename, "inode", (gint64)st->st_ino);
+    g_key_file_set_int64(keyfile, filename, "size", (gint64)st->st_size);
+    g_key_file_set_int64(keyfile, filename, "mtime",
+                         getNanoseconds(&st->st_mtim));
+    g_key_file_set_int64(keyfile, filename, "ctime",
+                         getNanoseconds(&st->st_ctim));
+    g_key_file_set_integer(keyfile, filename, "certs",
+                           (int)entry->certCount);
+    
+    for (size_t i = 0; i < entry->certCount; i++) {
+        const KeyIndexCert *cert = &entry->certs[i];
+        char *subject = base64_encode(cert->subject,
+                                      (int)cert->subjectLength);
+        setCertString(keyfile, filename, "subject", i, subject);
+        free(subject);
+        
+        char key[32];
+        snprintf(key, sizeof(key), "usages%zu", i);
+        g_key_file_set_integer(keyfile, filename, key, (int)cert->usages);
+        setCertString(keyfile, filename, "serialNumber", i,
+                      cert->serialNumber);
+    }
+    index->changed = true;
+}
+
+/**
+ * Saves the index if it has changed. If complete is true, then all key
+ * files have been looked up, and files that were not are removed from the
+ * index.
+ */
+void keyindex_save(KeyIndex *index, bool complete) {
+    if (!index) return;
+    
+    if (complete) {
+        gchar **groups = g_key_file_get_groups(index->keyfile, NULL);
+        for (gchar **group = groups; *group; group++) {
+            if (strcmp(*group, INDEX_GROUP) &&
+                !g_hash_table_lookup_extended(index->seen, *group,
+                                              NULL, NULL)) {
+                g_key_file_remove_group(index->keyfile, *group, NULL);
+                index->changed = true;
+            }
+        }
+        g_strfreev(groups);
+    }
+    
+    if (!index->changed) return;
+    
+    gsize length;
+    gchar *data = g_key_file_to_data(index->keyfile, &length, NULL);
+    if (!data) return;
+    
+    // The index contains names and personal numbers
+    g_mkdir_with_parents(index->path, 0700);
+    if (g_file_set_contents(index->filename, data, length, NULL)) {
+        index->changed = false;
+    }
+    g_free(data);
+}
+
+void keyindex_free(KeyIndex *index) {
+    if (!index) return;
+    free(index->filename);
+    free(index->path);
+    g_key_file_free(index->keyfile);
+    g_hash_table_destroy(index->seen);
+    free(index);
+}
+
+/**
+ * Adds an empty certificate to an index entry. Returns NULL if out of
+ * memory.
+ */
+KeyIndexCert *keyindex_addCert(KeyIndexEntry *entry) {
+    KeyIndexCert *certs = realloc(entry->certs,
+                                  (entry->certCount+1) * sizeof(KeyIndexCert));
+    if (!certs) return NULL;
+    
+    entry->certs = certs;
+    KeyIndexCert *cert = &certs[entry->certCount++];
+    memset(cert, 0, sizeof(KeyIndexCert));
+    return cert;
+}
+
+void keyindex_freeEntry(KeyIndexEntry *entry) {
+    for (size_t i = 0; i < entry->certCount; i++) {
+        KeyIndexCert *cert = &entry->certs[i];
+        free(cert->subject);
+        free(cert->serialNumber);
+    }
+    free(entry->certs);
+    entry->certCount = 0;
+    entry->certs = NULL;
+}
+
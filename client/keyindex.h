@@ -0,0 +1,60 @@
+/*
+
+  Copyright (c) 2026 Samuel Lidén Borell <samuel@kodafritt.se>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+  
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+*/
+
+#ifndef KEYINDEX_H
+#define KEYINDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/* Information about a certificate in a key file */
+typedef struct {
+    char *subject;          // DER encoded subject name
+    size_t subjectLength;
+    unsigned int usages;    // (1 << KeyUsage) for each usage it has
+    char *serialNumber;     // serialNumber in the subject, or NULL
+} KeyIndexCert;
+
+/* The certificates in a key file. Empty if it's not a valid key file */
+typedef struct {
+    size_t certCount;
+    KeyIndexCert *certs;
+} KeyIndexEntry;
+
+typedef struct KeyIndex KeyIndex;
+
+KeyIndex *keyindex_load(void);
+bool keyindex_lookup(KeyIndex *index, const char *filename,
+                     const struct stat *st, KeyIndexEntry *entry);
+void keyindex_store(KeyIndex *index, const char *filename,
+                    const struct stat *st, const KeyIndexEntry *entry);
+void keyindex_save(KeyIndex *index, bool complete);
+void keyindex_free(KeyIndex *index);
+
+KeyIndexCert *keyindex_addCert(KeyIndexEntry *entry);
+void keyindex_freeEntry(KeyIndexEntry *entry);
+
+#endif
+
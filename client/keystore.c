@@ -0,0 +1,580 @@
+/*
+
+  Copyright (c) 2009-2011, 2026 Samuel Lidén Borell <samuel@kodafritt.se>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+  
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+*/
+
+#define _BSD_SOURCE 1
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "../common/trace.h"
+#include "backend.h"
+#include "cancel.h"
+#include "keyindex.h"
+#include "keystore.h"
+#include "misc.h"
+#include "platform.h"
+
+/*
+  Key files in the key directories (~/cbt and ~/.cbt) and files that the
+  user has selected. This doesn't depend on the user interface, so it can
+  be done before the dialog is shown.
+*/
+
+// Prefetched tokens are not used after this many seconds, since the key
+// files may have changed
+#define PREFETCH_MAX_AGE 120
+
+// Key files that are not in the key index are parsed by at most this many
+// threads
+#define SCAN_MAX_THREADS 8
+
+// Key files are usually a few kilobytes. Larger files are not read in a
+// batch, since each file in a batch is read into an allocated buffer
+#define KEY_FILE_MAX_BATCH_SIZE (1024*1024)
+
+// Tokens that were found before a command was sent (see keystore_prefetch)
+static struct {
+    BackendNotifier *notifier;
+    KeyUsage keyUsage;
+    Token **tokens;
+    size_t count;
+    gint64 time;
+} prefetched;
+
+// Tokens from the files in the key directories, so they can be updated
+// when the files change (see keystore_watchKeyDirectories)
+static struct {
+    BackendNotifier *notifier;
+    Token **tokens;
+    size_t count;
+} keyDirTokens;
+
+// Tokens that have been found in the file that is being added
+static struct {
+    Token **tokens;
+    size_t count;
+} collected;
+
+static bool appendToken(Token ***tokens, size_t *count, Token *token) {
+    Token **newTokens = realloc(*tokens, (*count+1) * sizeof(Token*));
+    if (!newTokens) return false;
+    *tokens = newTokens;
+    (*tokens)[(*count)++] = token;
+    return true;
+}
+
+static void collectCallback(Token *token, TokenChange change) {
+    if (change != TokenChange_Added) return;
+    if (!appendToken(&collected.tokens, &collected.count, token)) {
+        token_free(token);
+    }
+}
+
+/**
+ * Passes the collected tokens on to the notification function, and keeps
+ * track of them so they can be updated if the file changes.
+ */
+static void addCollected(BackendNotifyFunction notifyFunction) {
+    for (size_t i = 0; i < collected.count; i++) {
+        Token *token = collected.tokens[i];
+        if (!token) continue;
+        
+        // Tokens that aren't tracked could never be removed
+        if (!appendToken(&keyDirTokens.tokens, &keyDirTokens.count, token)) {
+            token_free(token);
+            continue;
+        }
+        notifyFunction(token, TokenChange_Added);
+    }
+    collected.count = 0;
+}
+
+static void forgetToken(Token *token) {
+    for (size_t i = 0; i < keyDirTokens.count; i++) {
+        if (keyDirTokens.tokens[i] == token) {
+            memmove(&keyDirTokens.tokens[i], &keyDirTokens.tokens[i+1],
+                    (--keyDirTokens.count - i) * sizeof(Token*));
+            break;
+        }
+    }
+}
+
+static void resetKeyDirTokens(BackendNotifier *notifier) {
+    free(keyDirTokens.tokens);
+    keyDirTokens.notifier = notifier;
+    keyDirTokens.tokens = NULL;
+    keyDirTokens.count = 0;
+    free(collected.tokens);
+    collected.tokens = NULL;
+    collected.count = 0;
+}
+
+/**
+ * Reads a key file and adds it to the backend. The filename is used as
+ * the tag of the token.
+ */
+TokenError keystore_addFile(BackendNotifier *notifier, const char *filename) {
+    PlatformFile file;
+    if (!platform_mapFile(filename, &file))
+        return TokenError_FileNotReadable;
+    
+    TokenError error = backend_addFile(notifier, file.data, file.length,
+                                       strdup(filename));
+    
+    platform_unmapFile(&file);
+    return error;
+}
+
+/* A key file in a key directory */
+typedef struct {
+    char *filename;
+    struct stat st;
+    bool indexed;       // found in the key index
+    PlatformFile data;  // if it was read by readKeyFiles
+    TokenError error;   // from parseKeyFile
+    KeyIndexEntry entry;
+} KeyFile;
+
+/**
+ * Reads a key file and lists its certificates. This is called from the
+ * worker threads, so it must not use the key index or the notification
+ * function.
+ */
+static void parseKeyFile(gpointer data, gpointer userData) {
+    KeyFile *keyFile = (KeyFile *)data;
+    BackendNotifier *notifier = (BackendNotifier *)userData;
+    
+    // Files from readKeyFiles were not locked while they were read, so
+    // they are read again if they seem to be invalid
+    if (keyFile->data.data) {
+        keyFile->error = backend_indexFile(notifier, keyFile->data.data,
+                                           keyFile->data.length,
+                                           &keyFile->entry);
+        platform_unmapFile(&keyFile->data);
+        if (keyFile->error != TokenError_BadFile) return;
+    }
+    
+    PlatformFile file;
+    if (!platform_mapFile(keyFile->filename, &file)) {
+        keyFile->error = TokenError_FileNotReadable;
+        return;
+    }
+    
+    keyFile->error = backend_indexFile(notifier, file.data, file.length,
+                                       &keyFile->entry);
+    platform_unmapFile(&file);
+}
+
+/**
+ * Lists the files in the key directories, and looks them up in the key
+ * index (which may be NULL).
+ */
+static KeyFile *listKeyFiles(KeyIndex *index, size_t *count) {
+    KeyFile *keyFiles = NULL;
+    char** paths;
+    size_t len;
+    
+    *count = 0;
+    
+    // Look for P12s in ~/cbt and ~/.cbt
+    platform_keyDirs(&paths, &len);
+    for (size_t i = 0; i <= len; i++) {
+        PlatformDirIter *dir = platform_openKeysDir(paths[i]);
+        if (dir) {
+            while (!cancel_isRequested() && platform_iterateDir(dir)) {
+                char *filename = platform_currentPath(dir);
+                
+                KeyFile *newFiles = NULL;
+                struct stat st;
+                if (!strstr(filename, ".tmp") && stat(filename, &st) == 0 &&
+                    S_ISREG(st.st_mode)) {
+                    newFiles = realloc(keyFiles,
+                                       (*count+1) * sizeof(KeyFile));
+                }
+                if (!newFiles) {
+                    free(filename);
+                    continue;
+                }
+                
+                keyFiles = newFiles;
+                KeyFile *keyFile = &keyFiles[(*count)++];
+                memset(keyFile, 0, sizeof(KeyFile));
+                keyFile->filename = filename;
+                keyFile->st = st;
+                keyFile->indexed = (index &&
+                    keyindex_lookup(index, filename, &st, &keyFile->entry));
+            }
+            platform_closeDir(dir);
+        }
+        free(paths[i]);
+    }
+    return keyFiles;
+}
+
+/**
+ * Returns true if a key file should be read by readKeyFiles. Each of those
+ * files is read into a buffer, so large files are mapped by parseKeyFile
+ * instead.
+ */
+static bool isBatchRead(const KeyFile *keyFile) {
+    return (!keyFile->indexed && keyFile->st.st_size > 0 &&
+            keyFile->st.st_size <= KEY_FILE_MAX_BATCH_SIZE);
+}
+
+/**
+ * Reads the key files that are not in the key index in one batch, if
+ * possible. On network file systems this takes about as long as reading
+ * a single file. Files that are not read here are read by parseKeyFile.
+ */
+static void readKeyFiles(KeyFile *keyFiles, size_t count) {
+    size_t batchCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (isBatchRead(&keyFiles[i])) batchCount++;
+    }
+    if (batchCount <= 1) return;
+    
+    PlatformFileRead *reads = malloc(batchCount * sizeof(PlatformFileRead));
+    if (!reads) return;
+    
+    size_t r = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!isBatchRead(&keyFiles[i])) continue;
+        reads[r].filename = keyFiles[i].filename;
+        reads[r].length = (size_t)keyFiles[i].st.st_size;
+        r++;
+    }
+    
+    int64_t traceStart = trace_begin();
+    platform_readFiles(reads, batchCount);
+    trace_end("read key files", traceStart);
+    
+    r = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!isBatchRead(&keyFiles[i])) continue;
+        keyFiles[i].data = reads[r++].file;
+    }
+    free(reads);
+}
+
+/**
+ * Parses the key files that are not in the key index. This is done in a
+ * pool of threads, since there can be many files and the parsing is CPU
+ * bound.
+ */
+static void parseKeyFiles(BackendNotifier *notifier,
+                          KeyFile *keyFiles, size_t count) {
+    size_t unindexed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!keyFiles[i].indexed) unindexed++;
+    }
+    
+    if (unindexed > 1) readKeyFiles(keyFiles, count);
+    
+    gint threads = MIN((gint)g_get_num_processors(), SCAN_MAX_THREADS);
+    GThreadPool *pool = NULL;
+    if (unindexed > 1 && threads > 1) {
+        pool = g_thread_pool_new(parseKeyFile, notifier,
+                                 MIN((gint)unindexed, threads), FALSE, NULL);
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        if (keyFiles[i].indexed) continue;
+        if (!pool || !g_thread_pool_push(pool, &keyFiles[i], NULL)) {
+            parseKeyFile(&keyFiles[i], notifier);
+        }
+    }
+    
+    // Wait for all files to be parsed
+    if (pool) g_thread_pool_free(pool, FALSE, TRUE);
+}
+
+/**
+ * Adds the key files in the key directories. The files are parsed in
+ * parallel, but the tokens are added in the same order as the files are
+ * listed. Unchanged files are not read at all if they are in the key
+ * index.
+ */
+void keystore_addKeyDirectories(BackendNotifier *notifier) {
+    KeyIndex *index = keyindex_load();
+    if (keyDirTokens.notifier != notifier) resetKeyDirTokens(notifier);
+    
+    size_t count;
+    KeyFile *keyFiles = listKeyFiles(index, &count);
+    parseKeyFiles(notifier, keyFiles, count);
+    
+    BackendNotifyFunction notifyFunction =
+        backend_swapNotifyFunction(notifier, collectCallback);
+    for (size_t i = 0; i < count; i++) {
+        KeyFile *keyFile = &keyFiles[i];
+        
+        // Files that aren't key files are stored too, so they aren't
+        // parsed again next time
+        bool ok = (keyFile->indexed || !keyFile->error ||
+                   keyFile->error == TokenError_BadFile);
+        if (ok && index && !keyFile->indexed) {
+            keyindex_store(index, keyFile->filename, &keyFile->st,
+                           &keyFile->entry);
+        }
+        if (ok) {
+            backend_addIndexedFile(notifier, &keyFile->entry,
+                                   keyFile->filename,
+                                   strdup(keyFile->filename));
+            addCollected(notifyFunction);
+        }
+        
+        keyindex_freeEntry(&keyFile->entry);
+        free(keyFile->filename);
+    }
+    backend_swapNotifyFunction(notifier, notifyFunction);
+    free(keyFiles);
+    
+    if (index) {
+        // Files that weren't seen are removed, unless the scan was cancelled
+        keyindex_save(index, !cancel_isRequested());
+        keyindex_free(index);
+    }
+}
+
+static void prefetchCallback(Token *token, TokenChange change) {
+    switch (change) {
+        case TokenChange_Added: {
+            Token **tokens = realloc(prefetched.tokens,
+                                     (prefetched.count+1) * sizeof(Token*));
+            if (!tokens) {
+                token_free(token);
+                break;
+            }
+            prefetched.tokens = tokens;
+            prefetched.tokens[prefetched.count++] = token;
+            break;
+        }
+        case TokenChange_Changed:
+            break;
+        case TokenChange_Removed:
+            forgetToken(token);
+            for (size_t i = 0; i < prefetched.count; i++) {
+                if (prefetched.tokens[i] == token) {
+                    memmove(&prefetched.tokens[i], &prefetched.tokens[i+1],
+                            (--prefetched.count - i) * sizeof(Token*));
+                    token_free(token);
+                    break;
+                }
+            }
+            break;
+    }
+}
+
+static void discardPrefetched() {
+    for (size_t i = 0; i < prefetched.count; i++) {
+        token_free(prefetched.tokens[i]);
+    }
+    free(prefetched.tokens);
+    if (prefetched.notifier) {
+        if (keyDirTokens.notifier == prefetched.notifier) {
+            resetKeyDirTokens(NULL);
+        }
+        backend_freeNotifier(prefetched.notifier);
+    }
+    memset(&prefetched, 0, sizeof(prefetched));
+}
+
+static bool hasPrefetched(KeyUsage keyUsage) {
+    return (prefetched.notifier && prefetched.keyUsage == keyUsage &&
+            g_get_monotonic_time() - prefetched.time <
+                (gint64)PREFETCH_MAX_AGE * G_USEC_PER_SEC);
+}
+
+/**
+ * Reads and parses the key files in advance. This is done when the plugin
+ * expects that a dialog will be shown soon, so the tokens can be shown
+ * immediately when the command arrives (see keystore_takePrefetched).
+ * 
+ * Smart cards are not included, since they may be removed meanwhile.
+ */
+void keystore_prefetch(KeyUsage keyUsage) {
+    if (hasPrefetched(keyUsage)) return;
+    discardPrefetched();
+    
+    int64_t traceStart = trace_begin();
+    prefetched.notifier = backend_createNotifier(NULL, keyUsage,
+                                                 prefetchCallback);
+    prefetched.keyUsage = keyUsage;
+    prefetched.time = g_get_monotonic_time();
+    keystore_addKeyDirectories(prefetched.notifier);
+    trace_end("prefetch tokens", traceStart);
+}
+
+/**
+ * Returns the notifier from keystore_prefetch, with the given subject
+ * filter and notification function. The tokens that match the filter are
+ * passed to the notification function.
+ * 
+ * Returns NULL if nothing has been prefetched for this key usage, or if
+ * it's too old. The key directories must be added to a new notifier then.
+ */
+BackendNotifier *keystore_takePrefetched(const char *subjectFilter,
+                                         KeyUsage keyUsage,
+                                         BackendNotifyFunction notifyFunction) {
+    if (!hasPrefetched(keyUsage)) {
+        discardPrefetched();
+        return NULL;
+    }
+    
+    BackendNotifier *notifier = prefetched.notifier;
+    backend_setNotifyFunction(notifier, subjectFilter, notifyFunction);
+    for (size_t i = 0; i < prefetched.count; i++) {
+        Token *token = prefetched.tokens[i];
+        if (token_matchesSubjectFilter(token, subjectFilter)) {
+            notifyFunction(token, TokenChange_Added);
+        } else {
+            forgetToken(token);
+            token_free(token);
+        }
+    }
+    
+    free(prefetched.tokens);
+    memset(&prefetched, 0, sizeof(prefetched));
+    return notifier;
+}
+
+static void rescanKeyDirectories();
+
+/**
+ * Updates the tokens of a key file that has been created, changed or
+ * removed. Tokens for the same key are updated in place, so they stay
+ * selected in the dialog. Tokens of a removed file are passed to the
+ * notification function as removed, which frees them. If filename is
+ * NULL then all files in the key directories are checked.
+ */
+static void keyFileChanged(const char *filename) {
+    BackendNotifier *notifier = keyDirTokens.notifier;
+    if (!notifier) return;
+    if (!filename) {
+        rescanKeyDirectories();
+        return;
+    }
+    if (strstr(filename, ".tmp")) return;
+    
+    // Nothing is collected if the file has been removed
+    BackendNotifyFunction notifyFunction =
+        backend_swapNotifyFunction(notifier, collectCallback);
+    keystore_addFile(notifier, filename);
+    backend_swapNotifyFunction(notifier, notifyFunction);
+    
+    size_t i = 0;
+    while (i < keyDirTokens.count) {
+        Token *token = keyDirTokens.tokens[i];
+        const char *tag = token_getTag(token);
+        if (!tag || strcmp(tag, filename) != 0) {
+            i++;
+            continue;
+        }
+        
+        bool replaced = false;
+        for (size_t j = 0; j < collected.count && !replaced; j++) {
+            if (collected.tokens[j] &&
+                token_replace(token, collected.tokens[j])) {
+                collected.tokens[j] = NULL;
+                replaced = true;
+            }
+        }
+        
+        if (replaced) {
+            notifyFunction(token, TokenChange_Changed);
+            i++;
+        } else {
+            forgetToken(token);
+            notifyFunction(token, TokenChange_Removed);
+        }
+    }
+    
+    // Keys that are new in the file
+    addCollected(notifyFunction);
+}
+
+/**
+ * Checks all key files again, after some changes might have been missed.
+ * Files that still exist are read again, and the tokens of files that
+ * are gone are removed.
+ */
+static void rescanKeyDirectories() {
+    // The list of tokens changes while the files are checked
+    size_t tagCount = 0;
+    char **tags = malloc(keyDirTokens.count * sizeof(char*));
+    for (size_t i = 0; tags && i < keyDirTokens.count; i++) {
+        const char *tag = token_getTag(keyDirTokens.tokens[i]);
+        if (tag) tags[tagCount++] = strdup(tag);
+    }
+    
+    char **paths;
+    size_t len;
+    platform_keyDirs(&paths, &len);
+    for (size_t i = 0; i <= len; i++) {
+        PlatformDirIter *dir = platform_openKeysDir(paths[i]);
+        if (dir) {
+            while (platform_iterateDir(dir)) {
+                char *filename = platform_currentPath(dir);
+                keyFileChanged(filename);
+                for (size_t j = 0; j < tagCount; j++) {
+                    if (tags[j] && !strcmp(tags[j], filename)) {
+                        free(tags[j]);
+                        tags[j] = NULL;
+                    }
+                }
+                free(filename);
+            }
+            platform_closeDir(dir);
+        }
+        free(paths[i]);
+    }
+    
+    // Files that have been removed
+    for (size_t i = 0; i < tagCount; i++) {
+        if (tags[i]) keyFileChanged(tags[i]);
+        free(tags[i]);
+    }
+    free(tags);
+}
+
+/**
+ * Watches the key directories while a dialog is shown, so tokens are added,
+ * updated and removed when key files change. The notifier should be the
+ * one that keystore_addKeyDirectories was called with.
+ */
+void keystore_watchKeyDirectories(BackendNotifier *notifier) {
+    if (keyDirTokens.notifier != notifier) resetKeyDirTokens(notifier);
+    platform_watchKeyDirs(keyFileChanged);
+}
+
+/**
+ * Stops watching the key directories. Call this before the notifier is
+ * freed.
+ */
+void keystore_unwatchKeyDirectories() {
+    platform_unwatchKeyDirs();
+    resetKeyDirTokens(NULL);
+}
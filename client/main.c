@@ -29,15 +29,22 @@
 
 #include "../common/defines.h"
 #include "../common/pipe.h"
+#include "../common/trace.h"
+#include "../common/validate.h"
 #include "backend.h"
+#include "cancel.h"
 #include "bankid.h"
+#include "keystore.h"
 #include "platform.h"
 #include "prefs.h"
 #include "misc.h"
 #include "secmem.h"
+#include "status.h"
 
 static const char version[] = PACKAGEVERSION;
 static unsigned long browserWindowId = PLATFORM_NO_WINDOW;
+static bool persistent = false;
+static int tokenCount = 0;
 
 /**
  * Called when a token has been added or removed.
@@ -46,17 +53,75 @@ static void notifyCallback(Token *token, TokenChange change) {
     switch (change) {
         case TokenChange_Added:
             platform_addToken(token);
+            status_report(SignerStatus_TokensFound, ++tokenCount);
             break;
         case TokenChange_Changed:
-            // Not supported
+            platform_updateToken(token);
             break;
         case TokenChange_Removed:
             platform_removeToken(token);
             token_free(token);
+            status_report(SignerStatus_TokensFound, --tokenCount);
             break;
     }
 }
 
+/**
+ * Frees a list of items to authenticate or sign.
+ */
+static void freeSignItems(SignBatchItem *item) {
+    while (item) {
+        SignBatchItem *next = item->next;
+        free(item->challenge);
+        pipe_freeString(item->message);
+        free(item->invisibleMessage);
+        free(item);
+        item = next;
+    }
+}
+
+/**
+ * Decodes the texts of all items, to be displayed together. When there
+ * are several items, each text is preceded by its number and the number
+ * of items, so the user can see where each item begins.
+ *
+ * Returns NULL if any text can't be decoded (for example if it contains a
+ * null character) or if out of memory. All items are signed, so the
+ * command must be rejected then, rather than showing only some of them.
+ */
+static char *decodeSignItemTexts(const SignBatchItem *items,
+                                 size_t itemCount) {
+    char *text = NULL;
+    size_t i = 1;
+    
+    for (const SignBatchItem *item = items; item; item = item->next, i++) {
+        char *decoded = base64_decode(item->message);
+        if (!decoded) goto error;
+        
+        char *newText;
+        if (itemCount == 1) {
+            newText = decoded;
+            decoded = NULL;
+        } else if (text) {
+            newText = rasprintf_append(text, "\n\n[%u/%u]\n%s",
+                                       (unsigned)i, (unsigned)itemCount,
+                                       decoded);
+            text = NULL;
+        } else {
+            newText = rasprintf("[%u/%u]\n%s", (unsigned)i,
+                                (unsigned)itemCount, decoded);
+        }
+        free(decoded);
+        if (!newText) goto error;
+        text = newText;
+    }
+    return text;
+    
+  error:
+    free(text);
+    return NULL;
+}
+
 /**
  * Called when a command is being sent from the plugin.
  */
@@ -67,47 +132,92 @@ void pipeCommand(PipeCommand command, const char *url, const char *hostname,
             char *versionString = bankid_getVersion();
             
             pipe_sendString(stdout, versionString);
-            free(versionString);
             pipe_flush(stdout);
-            
-            platform_leaveMainloop();
+            free(versionString);
             break;
         }
         case PC_Authenticate:
-        case PC_Sign: {
-            char *challenge = pipe_readString(stdin);
+        case PC_Sign:
+        case PC_SignBatch: {
+            // A single authentication or signature is handled as a
+            // batch with one item
+            SignBatchItem *items = NULL;
+            size_t itemCount = 0;
+            char *challenge = NULL;
+            
+            if (command != PC_SignBatch) {
+                challenge = pipe_readString(stdin);
+            }
             int32_t serverTime = pipe_readInt(stdin);
             free(pipe_readOptionalString(stdin)); // Just ignore the policies list for now
             char *subjectFilter = pipe_readOptionalString(stdin);
-            char *messageEncoding = NULL, *message = NULL,
-                 *invisibleMessage = NULL;
-            if (command == PC_Sign) {
+            char *messageEncoding = NULL;
+            if (command != PC_Authenticate) {
                 messageEncoding = pipe_readString(stdin);
-                message = pipe_readString(stdin);
-                invisibleMessage = pipe_readOptionalString(stdin);
             }
             
-            // Validate input
-            BankIDError error = BIDERR_OK;
-            
-            if (!is_https_url(url)) {
-                error = BIDERR_NotSSL;
-            } else if (!is_canonical_base64(challenge) ||
-                       !is_valid_hostname(hostname) ||
-                       !is_valid_ip_address(ip) ||
-                       (command == PC_Sign && (
-                           !is_canonical_base64(message) ||
-                           (invisibleMessage && !is_canonical_base64(invisibleMessage))
-                       ))) {
+            if (command == PC_SignBatch) {
+                SignBatchItem **last = &items;
+                while (pipe_readInt(stdin) == PLS_MoreData) {
+                    SignBatchItem *item = calloc(1, sizeof(SignBatchItem));
+                    if (!item) break;
+                    item->challenge = pipe_readString(stdin);
+                    item->message = pipe_readLargeString(stdin);
+                    item->invisibleMessage = pipe_readOptionalString(stdin);
+                    
+                    *last = item;
+                    last = &item->next;
+                    itemCount++;
+                }
+            } else {
+                items = calloc(1, sizeof(SignBatchItem));
+                if (items) {
+                    items->challenge = challenge;
+                    if (command == PC_Sign) {
+                        items->message = pipe_readLargeString(stdin);
+                        items->invisibleMessage = pipe_readOptionalString(stdin);
+                    }
+                    itemCount = 1;
+                } else {
+                    free(challenge);
+                }
+            }
+            
+            // Validate input. The plugin checks this too (see plugin.c)
+            BankIDError error = validate_origin(url, hostname, ip);
+            
+            if (error == BIDERR_OK && (!items || itemCount > MAX_BATCH_ITEMS)) {
+                error = BIDERR_InternalError;
+            }
+            for (SignBatchItem *item = items; item && error == BIDERR_OK;
+                 item = item->next) {
+                if (!validate_signItem(item, command == PC_Authenticate)) {
+                    error = BIDERR_InternalError;
+                }
+            }
+            
+            // All texts are shown in the same dialog
+            char *decodedMessage = NULL;
+            if (error == BIDERR_OK && command != PC_Authenticate) {
+                decodedMessage = decodeSignItemTexts(items, itemCount);
+                if (!decodedMessage) error = BIDERR_InternalError;
+            }
+            
+            // The dialog can't be shown without the user interface module
+            if (error == BIDERR_OK && !platform_hasUI()) {
                 error = BIDERR_InternalError;
             }
             
             if (error != BIDERR_OK) {
                 pipe_sendInt(stdout, error);
-                pipe_sendString(stdout, "");
+                for (size_t i = 0; i < (itemCount ? itemCount : 1); i++) {
+                    pipe_sendString(stdout, "");
+                }
                 pipe_flush(stdout);
-                
-                platform_leaveMainloop();
+                free(decodedMessage);
+                freeSignItems(items);
+                free(subjectFilter);
+                free(messageEncoding);
                 return;
             }
             
@@ -120,18 +230,24 @@ void pipeCommand(PipeCommand command, const char *url, const char *hostname,
             Token *token;
             char *password = NULL;
             long password_maxsize = 0;
-            char *signature = NULL;
+            char **signatures = calloc(itemCount, sizeof(char*));
             char *decodedSubjectFilter = NULL;
             error = BIDERR_UserCancel;
 
             // Allocate a secure page for the password
             password = secmem_get_page(&password_maxsize);
-            if (!password || !password_maxsize) {
+            if (!password || !password_maxsize || !signatures) {
                 pipe_sendInt(stdout, BIDERR_InternalError);
-                pipe_sendString(stdout, "");
+                for (size_t i = 0; i < itemCount; i++) {
+                    pipe_sendString(stdout, "");
+                }
                 pipe_flush(stdout);
-                
-                platform_leaveMainloop();
+                secmem_free_page(password);
+                free(decodedMessage);
+                free(signatures);
+                freeSignItems(items);
+                free(subjectFilter);
+                free(messageEncoding);
                 return;
             }
 
@@ -141,20 +257,30 @@ void pipeCommand(PipeCommand command, const char *url, const char *hostname,
             }
             
             // Pass all parameters to the user interface
+            tokenCount = 0;
             platform_startSign(url, hostname, ip, browserWindowId);
-            BackendNotifier *notifier = backend_createNotifier(
-                decodedSubjectFilter,
-                (command == PC_Sign ?
-                    KeyUsage_Signing : KeyUsage_Authentication),
-                notifyCallback);
-            platform_setNotifier(notifier);
-            platform_addKeyDirectories();
+            KeyUsage keyUsage = (command == PC_Authenticate ?
+                KeyUsage_Authentication : KeyUsage_Signing);
+            int64_t traceStart = trace_begin();
+            
+            // The key files may have been read already (see PC_Prefetch)
+            BackendNotifier *notifier = keystore_takePrefetched(
+                decodedSubjectFilter, keyUsage, notifyCallback);
+            if (notifier) {
+                platform_setNotifier(notifier);
+            } else {
+                notifier = backend_createNotifier(decodedSubjectFilter,
+                                                  keyUsage, notifyCallback);
+                platform_setNotifier(notifier);
+                keystore_addKeyDirectories(notifier);
+            }
+            keystore_watchKeyDirectories(notifier);
             backend_scanTokens(notifier);
+            trace_end("scan tokens", traceStart);
             free(decodedSubjectFilter);
+            if (tokenCount == 0) status_report(SignerStatus_TokensFound, 0);
             
-            if (command == PC_Sign) {
-                if (!message) abort();
-                char *decodedMessage = base64_decode(message);
+            if (decodedMessage) {
                 platform_setMessage(decodedMessage);
                 free(decodedMessage);
             }
@@ -162,46 +288,77 @@ void pipeCommand(PipeCommand command, const char *url, const char *hostname,
             if (bankid_versionHasExpired()) {
                 platform_versionExpiredError();
             }
-
+            
+            status_report(SignerStatus_DialogShown, 0);
+            traceStart = trace_begin();
             while (platform_sign(&token, password, password_maxsize)) {
-                // Set the password (not used by all backends)
+                trace_end("wait for user", traceStart);
+                
+                // Set the password (not used by all backends). The key is
+                // only unlocked once for all items in a batch.
                 token_usePassword(token, password);
+                token_keepKey(token, itemCount > 1);
                 
                 // Try to authenticate/sign
-                if (command == PC_Authenticate) {
-                    error = bankid_authenticate(token, challenge, serverTime,
-                                                hostname, ip, &signature);
-                } else {
-                    error = bankid_sign(token, challenge, serverTime,
-                                        hostname, ip, messageEncoding,
-                                        message, invisibleMessage,
-                                        &signature);
+                size_t i = 0;
+                for (SignBatchItem *item = items; item; item = item->next, i++) {
+                    status_report(SignerStatus_Signing, (int)i);
+                    if (command == PC_Authenticate) {
+                        error = bankid_authenticate(token, item->challenge,
+                                                    serverTime, hostname, ip,
+                                                    &signatures[i]);
+                    } else {
+                        error = bankid_sign(token, item->challenge, serverTime,
+                                            hostname, ip, messageEncoding,
+                                            item->message,
+                                            item->invisibleMessage,
+                                            &signatures[i]);
+                    }
+                    if (error != BIDERR_OK) break;
                 }
                 
+                token_keepKey(token, false);
                 guaranteed_memset(password, 0, password_maxsize);
                 
                 if (error == BIDERR_OK) break;
                 
+                // Don't return a partial batch
+                for (i = 0; i < itemCount; i++) {
+                    free(signatures[i]);
+                    signatures[i] = NULL;
+                }
+                
+                if (cancel_isRequested()) break;
+                
                 platform_showError(token_getLastError(token));
+                status_report(SignerStatus_DialogShown, 0);
                 error = BIDERR_UserCancel;
+                traceStart = trace_begin();
+            }
+            
+            if (error != BIDERR_OK && cancel_isRequested()) {
+                error = BIDERR_Timeout;
             }
 
             secmem_free_page(password);
 
             platform_endSign();
             
+            keystore_unwatchKeyDirectories();
             backend_freeNotifier(notifier);
             free(messageEncoding);
-            free(message);
-            free(invisibleMessage);
-            free(challenge);
+            freeSignItems(items);
             
             pipe_sendInt(stdout, error);
-            pipe_sendString(stdout, (signature ? signature : ""));
+            for (size_t i = 0; i < itemCount; i++) {
+                pipe_sendString(stdout, (signatures[i] ? signatures[i] : ""));
+            }
             pipe_flush(stdout);
             
-            free(signature);
-            platform_leaveMainloop();
+            for (size_t i = 0; i < itemCount; i++) {
+                free(signatures[i]);
+            }
+            free(signatures);
             break;
         }
         case PC_CreateRequest: {
@@ -231,15 +388,26 @@ void pipeCommand(PipeCommand command, const char *url, const char *hostname,
                 input.pkcs10 = pkcs10;
             }
             
-            // CMC
-            input.cmc.oneTimePassword = pipe_readString(stdin);
+            // CMC. The one-time password is read into secure memory
+            long otp_maxsize = 0;
+            char *otp = secmem_get_page(&otp_maxsize);
+            bool otpOk = false;
+            if (otp) {
+                otpOk = pipe_readStringInto(stdin, otp, (size_t)otp_maxsize);
+            } else {
+                free(pipe_readString(stdin));
+            }
+            input.cmc.oneTimePassword = otp;
             input.cmc.rfc2729cmcoid = pipe_readString(stdin);
             
             // Check for broken pipe
-            if (feof(stdin)) goto createReq_end;
+            if (pipe_hasError(stdin)) goto createReq_end;
             
             // Check input
-            if (!input.pkcs10) goto createReq_end;
+            if (!otpOk || !input.pkcs10) goto createReq_end;
+            
+            // The dialog can't be shown without the user interface module
+            if (!platform_hasUI()) goto createReq_end;
             
             // Get name to display
             name = bankid_getRequestDisplayName(&input);
@@ -259,6 +427,7 @@ void pipeCommand(PipeCommand command, const char *url, const char *hostname,
             }
             
             for (;;) {
+                status_report(SignerStatus_DialogShown, 0);
                 error = RUERR_UserCancel;
                 // Ask for a password
                 if (!platform_choosePassword(password, password_maxsize))
@@ -273,70 +442,234 @@ void pipeCommand(PipeCommand command, const char *url, const char *hostname,
                 guaranteed_memset(password, 0, password_maxsize);
                 
                 if (error == BIDERR_OK) break;
+                if (cancel_isRequested()) break;
                 
                 platform_showError(tokenError);
             }
             
+            if (error != BIDERR_OK && cancel_isRequested()) {
+                error = BIDERR_Timeout;
+            }
+            
             platform_endChoosePassword();
             
             // Send result
           createReq_end:
             secmem_free_page(password);
+            secmem_free_page(otp);
             pipe_sendInt(stdout, error);
             
-            if (!request) pipe_sendString(stdout, "");
-            else {
-                pipe_sendString(stdout, request);
-                free(request);
-            }
-            
+            pipe_sendString(stdout, (request ? request : ""));
             pipe_flush(stdout);
-            platform_leaveMainloop();
+            
+            free(request);
             break;
         }
         case PC_StoreCertificates: {
             // TODO maybe we should only allow the web site that called
             //      CreateRequest to store certificates?
             
-            char *certs = pipe_readString(stdin);
+            // This may be large, so it's mapped if it's sent in a memfd
+            char *certs = pipe_readLargeString(stdin);
             
             BankIDError error = bankid_storeCertificates(certs, hostname);
+            pipe_freeString(certs);
             
             pipe_sendInt(stdout, error);
             pipe_flush(stdout);
-            
-            platform_leaveMainloop();
             break;
         }
+        case PC_Cancel:
+        case PC_Prefetch:
+            // Handled in handleRequest
+            break;
     }
 }
 
+static bool commandRunning = false;
+static uint32_t runningRequestId = 0;
+static bool cancelReceived = false;
+static bool nestedRunning = false;
+
 /**
- * pipeData is called when the plugin has sent some data.
- * This happens when one of the Javascript methods of an
- * plugin object is called.
+ * Returns true for commands that don't show a dialog. These may be sent
+ * by the plugin while another command is running.
  */
-void pipeData() {
-    PipeCommand command = pipe_readCommand(stdin);
+static bool isQuickCommand(PipeCommand command) {
+    return (command == PC_GetVersion || command == PC_StoreCertificates);
+}
+
+/**
+ * Returns the name of a command, for the trace file.
+ */
+static const char *getCommandName(PipeCommand command) {
+    switch (command) {
+        case PC_GetVersion:        return "GetVersion";
+        case PC_Authenticate:      return "Authenticate";
+        case PC_Sign:              return "Sign";
+        case PC_CreateRequest:     return "CreateRequest";
+        case PC_StoreCertificates: return "StoreCertificates";
+        case PC_SignBatch:         return "SignBatch";
+        default:                   return "command";
+    }
+}
+
+/**
+ * Reads the common part of a request and runs the command. If nested is
+ * true, then another command is running already (and has read all of its
+ * input), so the window id and timeout of that command are kept.
+ */
+static void runRequest(PipeCommand command, bool nested) {
     char *url = pipe_readString(stdin);
     char *hostname = pipe_readString(stdin);
     char *ip = pipe_readString(stdin);
+    unsigned long windowId = browserWindowId;
+    int timeout = 0;
+    uint32_t outerTraceId = trace_getId();
+    if (persistent) {
+        windowId = (unsigned long)pipe_readInt64(stdin);
+        timeout = pipe_readInt(stdin);
+        if (pipe_getFeatures(stdin) & PF_TraceId) {
+            trace_setId((uint32_t)pipe_readInt(stdin));
+        }
+    }
     
-    pipeCommand(command, url, hostname, ip);
+    int64_t traceStart = trace_begin();
+    if (nested) {
+        nestedRunning = true;
+        pipeCommand(command, url, hostname, ip);
+        nestedRunning = false;
+    } else {
+        // The process may have been running for a long time (see
+        // persistent), and the preferences or the expiry information may
+        // have changed since it was started
+        prefs_load();
+        bankid_checkVersionValidity();
+        
+        browserWindowId = windowId;
+        commandRunning = true;
+        runningRequestId = pipe_getRequestId(stdout);
+        cancelReceived = false;
+        
+        cancel_start(timeout);
+        pipeCommand(command, url, hostname, ip);
+        cancel_end();
+        
+        commandRunning = false;
+    }
+    trace_end(getCommandName(command), traceStart);
+    trace_setId(outerTraceId);
     
     free(ip);
     free(hostname);
     free(url);
 }
 
+/**
+ * Handles a frame (or line) that has been received from the plugin.
+ */
+static void handleRequest() {
+    if (pipe_readHello(stdin)) {
+        // Start of a framed connection. Reply with our features.
+        pipe_sendHello(stdout);
+        return;
+    }
+    
+    PipeCommand command = pipe_readCommand(stdin);
+    if (command == PC_Cancel) {
+        // The command might have completed already
+        if (commandRunning &&
+            pipe_getRequestId(stdout) == runningRequestId) {
+            cancelReceived = true;
+        }
+    } else if (command == PC_Prefetch) {
+        // A dialog will probably be shown soon. There's no reply.
+        KeyUsage keyUsage = (KeyUsage)pipe_readInt(stdin);
+        if (!commandRunning && (keyUsage == KeyUsage_Authentication ||
+                                keyUsage == KeyUsage_Signing)) {
+            keystore_prefetch(keyUsage);
+        }
+    } else if (!commandRunning) {
+        runRequest(command, false);
+        
+        if (!persistent) {
+            platform_leaveMainloop();
+        }
+    } else if (isQuickCommand(command)) {
+        runRequest(command, true);
+    } else {
+        // The plugin only sends quick commands to a busy signer
+        pipe_sendInt(stdout, BIDERR_InternalError);
+        pipe_sendString(stdout, "");
+        pipe_flush(stdout);
+    }
+    
+    // The status and reply of the running command use its request id
+    if (commandRunning) {
+        pipe_setRequestId(stdout, runningRequestId);
+    }
+}
+
+/**
+ * Serves requests that have arrived while a command is running, and
+ * checks if the plugin has cancelled the command.
+ */
+static bool pollPipe() {
+    while (!nestedRunning) {
+        PipeReceiveStatus status = pipe_receiveNext(stdin);
+        if (status == PRS_Incomplete) break;
+        if (status == PRS_End) {
+            cancelReceived = true;
+            break;
+        }
+        handleRequest();
+    }
+    return cancelReceived;
+}
+
+/**
+ * Sends the progress of the current command to the plugin.
+ */
+static void sendStatus(SignerStatus status, int value) {
+    pipe_sendStatus(stdout, status, value);
+}
+
+/**
+ * pipeData is called when the plugin has sent some data.
+ * This happens when one of the Javascript methods of an
+ * plugin object is called. The command is run when the whole
+ * request has been received.
+ *
+ * This is also called from the main loop of the dialogs, while a command
+ * is running. Quick commands are run immediately in that case.
+ *
+ * In persistent mode the process keeps serving commands until the plugin
+ * closes the pipe. Otherwise it exits after the first command.
+ */
+void pipeData() {
+    switch (pipe_receive(stdin)) {
+        case PRS_Incomplete:
+            return;
+        case PRS_End:
+            cancelReceived = true;
+            platform_leaveMainloop();
+            return;
+        case PRS_Complete:
+            break;
+    }
+    
+    handleRequest();
+}
+
 int main(int argc, char **argv) {
     bool ipc = false, error = false;
+    int64_t traceStart = trace_begin();
     
     platform_seedRandom();
-    prefs_load();
     
-    /* Check whether the current version is still valid */
-    bankid_checkVersionValidity();
+    // Loaded again before each command (see runRequest). The preferences
+    // are needed for PC_Prefetch too.
+    prefs_load();
     
     error = secmem_init_pool();
     if (error) {
@@ -349,6 +682,9 @@ int main(int argc, char **argv) {
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "--internal--ipc=" IPCVERSION)) {
             ipc = true;
+            pipe_initFramed(stdin, stdout);
+        } else if (!strcmp(argv[i], "--internal--ipc=" IPCVERSION_TEXT)) {
+            ipc = true;
         } else if (!strncmp(argv[i], "--internal--ipc", 15)) {
             fprintf(stderr, BINNAME ": Version mismatch. "
                     "Plugin version: %s,  Signer version: " IPCVERSION "\n",
@@ -362,6 +698,8 @@ int main(int argc, char **argv) {
                 break;
             }
             browserWindowId = atol(argv[i]);
+        } else if (!strcmp(argv[i], "--internal--persistent")) {
+            persistent = true;
         } else {
             fprintf(stderr, BINNAME ": Invalid option: %s\n", argv[i]);
             error = true;
@@ -375,7 +713,10 @@ int main(int argc, char **argv) {
 
     /* Set up pipe */
     if (ipc) {
+        cancel_setPollFunction(pollPipe);
+        status_setFunction(sendStatus);
         platform_setupPipe(pipeData);
+        trace_end("signer startup", traceStart);
     } else {
         fprintf(stderr, "This is an internal program.\n");
         secmem_destroy_pool();
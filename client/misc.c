@@ -146,26 +146,52 @@ char *base64_encode(const char *data, int length) {
     return base64;
 }
 
-char *base64_decode(const char *encoded) {
-    gsize length;
-
-    char *temp = (char*)g_base64_decode(encoded, &length);
-    if (!temp) goto error;
+/**
+ * Encodes several pieces as one Base64 string, without concatenating them
+ * first. The result doesn't contain any newlines.
+ */
+char *base64_encode_pieces(const StringPiece *pieces, size_t count) {
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++) {
+        ADD_LENGTH(length, pieces[i].length);
+    }
+    if (length > (SIZE_T_MAX - 8) / 4 * 3) goto error;
     
-    char *result = malloc(length+1);
+    char *result = malloc(length / 3 * 4 + 8);
     if (!result) goto error;
     
-    memcpy(result, temp, length);
-    result[length] = '\0';
-    free(temp);
+    char *end = result;
+    gint state = 0, save = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (pieces[i].length == 0) continue;
+        end += g_base64_encode_step((const guchar*)pieces[i].data,
+                                    pieces[i].length, FALSE,
+                                    end, &state, &save);
+    }
+    end += g_base64_encode_close(FALSE, end, &state, &save);
+    *end = '\0';
+    return result;
     
-    return utf8_or_latin1(result, length);
-  
   error:
-    free(temp);
     return NULL;
 }
 
+char *base64_decode(const char *encoded) {
+    size_t encodedLength = strlen(encoded);
+    
+    // Decode directly into a null terminated buffer
+    char *result = malloc(encodedLength / 4 * 3 + 4);
+    if (!result) return NULL;
+    
+    gint state = 0;
+    guint save = 0;
+    gsize length = g_base64_decode_step(encoded, encodedLength,
+                                        (guchar*)result, &state, &save);
+    result[length] = '\0';
+    
+    return utf8_or_latin1(result, length);
+}
+
 char *base64_decode_binary(const char *encoded, size_t *decodedLength) {
     gsize length;
 
@@ -181,55 +207,35 @@ char *base64_decode_binary(const char *encoded, size_t *decodedLength) {
     return result;
 }
 
-bool is_canonical_base64(const char *encoded) {
-    /* Try to decode */
-    gsize length;
-    char *decoded = (char*)g_base64_decode(encoded, &length);
-    if (!decoded) return false;
-    
-    /* Recode and verify that it's equal to the encoded data */
-    char *recoded = base64_encode(decoded, length);
-    bool equal = recoded && !strcmp(recoded, encoded);
-    
-    free(recoded);
-    free(decoded);
-    return equal;
+char *sha_base64(const char *str) {
+    StringPiece piece = { str, strlen(str) };
+    return sha_base64_pieces(&piece, 1);
 }
 
-char *sha_base64(const char *str) {
+/**
+ * Calculates the SHA-256 hash of several pieces, as if they were one
+ * string, and returns it in Base64.
+ */
+char *sha_base64_pieces(const StringPiece *pieces, size_t count) {
     unsigned char shasum[SHA256_DIGEST_LENGTH];
     EVP_MD_CTX mdctx;
     const EVP_MD *md;
     unsigned int md_len;
     char *result = NULL;
+    bool ok;
 
     md = EVP_sha256();
     EVP_MD_CTX_init(&mdctx);
     
-    if (EVP_DigestInit_ex(&mdctx, md, NULL) &&
-        EVP_DigestUpdate(&mdctx, str, strlen(str)) &&
-        EVP_DigestFinal_ex(&mdctx, shasum, &md_len)) {
+    ok = EVP_DigestInit_ex(&mdctx, md, NULL);
+    for (size_t i = 0; ok && i < count; i++) {
+        ok = EVP_DigestUpdate(&mdctx, pieces[i].data, pieces[i].length);
+    }
+    
+    if (ok && EVP_DigestFinal_ex(&mdctx, shasum, &md_len)) {
         result = base64_encode((const char*)shasum, sizeof(shasum));
     }
     
     EVP_MD_CTX_cleanup(&mdctx);
     return result;
 }
-
-bool is_valid_domain_name(const char *domain) {
-    static const char allowed[] = "abcdefghijklmnopqrstuvwxyz0123456789-.";
-    return (strspn(domain, allowed) == strlen(domain));
-}
-
-bool is_valid_ip_address(const char *ip) {
-    static const char allowed[] = "0123456789abcdef.[]:";
-    return (strspn(ip, allowed) == strlen(ip));
-}
-
-bool is_valid_hostname(const char *hostname) {
-    return is_valid_domain_name(hostname) || is_valid_ip_address(hostname);
-}
-
-bool is_https_url(const char *url) {
-    return !strncmp(url, "https://", 8);
-}
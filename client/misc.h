@@ -26,6 +26,7 @@
 #define MISC_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #define SIZE_T_MAX ((size_t)-1)
 
@@ -39,20 +40,25 @@
     (var) += (length); \
 } while (0)
 
+/**
+ * A part of a string. The data is not null terminated. This is used to
+ * process large strings in pieces, without concatenating them.
+ */
+typedef struct {
+    const char *data;
+    size_t length;
+} StringPiece;
+
 char *rasprintf(const char *format, ...);
 char *rasprintf_append(char *str, const char *format, ...);
 void *guaranteed_memset(void *v, int c, size_t n);
 
 char *base64_encode(const char *data, const int length);
+char *base64_encode_pieces(const StringPiece *pieces, size_t count);
 char *base64_decode(const char *encoded);
 char *base64_decode_binary(const char *encoded, size_t *decodedLength);
-bool is_canonical_base64(const char *encoded);
 char *sha_base64(const char *str);
-
-bool is_valid_domain_name(const char *domain);
-bool is_valid_ip_address(const char *ip);
-bool is_valid_hostname(const char *hostname);
-bool is_https_url(const char *url);
+char *sha_base64_pieces(const StringPiece *pieces, size_t count);
 
 #endif
 
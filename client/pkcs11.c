@@ -47,6 +47,8 @@ typedef struct PKCS11Private PKCS11Private;
 #include "certutil.h"
 #include "misc.h"
 #include "backend_private.h"
+#include "cancel.h"
+#include "status.h"
 #include "prefs.h"
 
 struct PKCS11Token {
@@ -54,6 +56,7 @@ struct PKCS11Token {
     PKCS11_SLOT *slot;
     PKCS11_CERT *certs;
     unsigned int ncerts;
+    bool loggedIn;
 };
 
 struct PKCS11Private {
@@ -62,6 +65,13 @@ struct PKCS11Private {
     PKCS11_SLOT *slots;
 };
 
+static void _backend_releaseKey(PKCS11Token *token) {
+    if (token->loggedIn) {
+        PKCS11_logout(token->slot);
+        token->loggedIn = false;
+    }
+}
+
 static void _backend_freeToken(PKCS11Token *token) {
     free(token);
 }
@@ -127,9 +137,16 @@ static TokenError _backend_sign(PKCS11Token *token,
     
     if (messagelen >= UINT_MAX) return TokenError_MessageTooLong;
     
-    if (token->slot->token->loginRequired) {
+    if (cancel_isRequested()) return TokenError_Cancelled;
+    
+    if (token->slot->token->loginRequired && !token->loggedIn) {
+        status_report(SignerStatus_UnlockingKey, 0);
         if (PKCS11_login(token->slot, 0, token->base.password) != 0)
             return TokenError_BadPin;
+        status_keyUnlocked();
+        
+        // Don't ask for the PIN again for the rest of a batch
+        token->loggedIn = token->base.keepKey;
     }
 
     // Find the key for the token
@@ -200,6 +217,7 @@ fail:
  */
 static void _backend_scan(Backend *backend) {
     for (unsigned int i = 0; i < backend->private->nslots; i++) {
+        if (cancel_isRequested()) break;
         if (backend->private->slots[i].token) {
             pkcs11_found_token(backend, &backend->private->slots[i]);
         }
@@ -257,6 +275,7 @@ static const Backend backend_template = {
     .freeToken = _backend_freeToken,
     .getBase64Chain = _backend_getBase64Chain,
     .sign = _backend_sign,
+    .releaseKey = _backend_releaseKey,
 };
 
 Backend *pkcs11_getBackend() {
@@ -48,6 +48,9 @@ typedef struct PKCS12Token PKCS12Token;
 #include "platform.h"
 #include "request.h"
 #include "backend_private.h"
+#include "cancel.h"
+#include "status.h"
+#include "../common/trace.h"
 
 typedef struct {
     int refCount;
@@ -60,10 +63,19 @@ struct PKCS12Token {
     SharedPKCS12 *sharedP12;
     int p12Index;
     const X509_NAME *subjectName;
+    
+    // For tokens from the key index, the P12 is loaded from this file
+    // when the token is used. The subject name is owned by the token.
+    char *filename;
+    X509_NAME *indexedName;
+    
+    // Decrypted private key, while base.keepKey is set
+    EVP_PKEY *key;
 };
 
 static bool _backend_init(Backend *backend) {
     OpenSSL_add_all_algorithms();
+    certutil_initThreads();
     //listTokens(backend);
     return true;
 }
@@ -130,6 +142,9 @@ static EVP_PKEY *getPrivateKey(PKCS12 *p12, X509 *x509, const char* pass) {
             PKCS12_SAFEBAG *bag = sk_PKCS12_SAFEBAG_value(safebags, i);
             if (!bag) continue;
             
+            // Decryption is slow, so check for cancellation between keys
+            if (cancel_isRequested()) break;
+            
             switch (M_PKCS12_bag_type(bag)) {
                 case NID_pkcs8ShroudedKeyBag:;
                     // Encrypted key
@@ -225,11 +240,38 @@ static PKCS12Token *createToken(const Backend *backend, SharedPKCS12 *sharedP12,
     return token;
 }
 
+static void _backend_releaseKey(PKCS12Token *token) {
+    if (token->key) {
+        EVP_PKEY_free(token->key);
+        token->key = NULL;
+    }
+}
+
 static void _backend_freeToken(PKCS12Token *token) {
-    pkcs12_release(token->sharedP12);
+    _backend_releaseKey(token);
+    if (token->sharedP12) pkcs12_release(token->sharedP12);
+    if (token->indexedName) X509_NAME_free(token->indexedName);
+    free(token->filename);
     free(token);
 }
 
+/**
+ * Loads the P12 file of a token from the key index, if it hasn't been
+ * loaded already.
+ */
+static TokenError loadIndexedToken(PKCS12Token *token) {
+    if (token->sharedP12) return TokenError_Success;
+    
+    PlatformFile file;
+    if (!platform_mapFile(token->filename, &file)) {
+        return TokenError_FileNotReadable;
+    }
+    token->sharedP12 = pkcs12_parse(file.data, (int)file.length);
+    platform_unmapFile(&file);
+    
+    return (token->sharedP12 ? TokenError_Success : TokenError_BadFile);
+}
+
 /**
  * Adds all subjects in a PKCS12 files and notifies the frontend of them.
  */
@@ -266,6 +308,124 @@ static TokenError _backend_addFile(Backend *backend,
     return TokenError_Success;
 }
 
+static bool _backend_matchSubjectFilter(const PKCS12Token *token,
+                                        const char *subjectFilter) {
+    return certutil_matchSubjectFilter(subjectFilter,
+                                       (X509_NAME *)token->subjectName);
+}
+
+static bool _backend_replaceToken(PKCS12Token *token,
+                                  PKCS12Token *replacement) {
+    if (X509_NAME_cmp(token->subjectName, replacement->subjectName) != 0) {
+        return false;
+    }
+    
+    _backend_releaseKey(token);
+    if (token->sharedP12) pkcs12_release(token->sharedP12);
+    if (token->indexedName) X509_NAME_free(token->indexedName);
+    free(token->filename);
+    free(token->base.displayName);
+    
+    // The tag and password settings of the existing token are kept
+    token->base.lastError = replacement->base.lastError;
+    token->base.status = replacement->base.status;
+    token->base.displayName = replacement->base.displayName;
+    token->sharedP12 = replacement->sharedP12;
+    token->p12Index = replacement->p12Index;
+    token->subjectName = replacement->subjectName;
+    token->filename = replacement->filename;
+    token->indexedName = replacement->indexedName;
+    free(replacement);
+    return true;
+}
+
+/**
+ * Lists the certificates of a PKCS12 file, for the key index.
+ */
+static TokenError _backend_indexFile(Backend *backend,
+                                     const char *data, size_t length,
+                                     KeyIndexEntry *entry) {
+    SharedPKCS12 *p12 = pkcs12_parse(data, length);
+    if (!p12) return TokenError_BadFile;
+    
+    STACK_OF(X509) *certList = pkcs12_listCerts(p12->data);
+    pkcs12_release(p12);
+    if (!certList) return TokenError_Unknown;
+    
+    TokenError error = TokenError_Success;
+    int certCount = sk_X509_num(certList);
+    for (int i = 0; i < certCount; i++) {
+        X509 *x = sk_X509_value(certList, i);
+        X509_NAME *name = X509_get_subject_name(x);
+        
+        KeyIndexCert *cert = keyindex_addCert(entry);
+        unsigned char *der = NULL;
+        int derLength = i2d_X509_NAME(name, &der);
+        if (!cert || derLength <= 0 || !(cert->subject = malloc(derLength))) {
+            OPENSSL_free(der);
+            error = TokenError_Unknown;
+            break;
+        }
+        memcpy(cert->subject, der, derLength);
+        cert->subjectLength = (size_t)derLength;
+        OPENSSL_free(der);
+        
+        const KeyUsage usages[] = {
+            KeyUsage_Issuing, KeyUsage_Signing, KeyUsage_Authentication,
+        };
+        for (size_t u = 0; u < sizeof(usages)/sizeof(usages[0]); u++) {
+            if (certutil_hasKeyUsage(x, usages[u])) {
+                cert->usages |= 1 << usages[u];
+            }
+        }
+        
+        cert->serialNumber = certutil_getNamePropertyByNID(name,
+                                                           NID_serialNumber);
+    }
+    
+    sk_X509_pop_free(certList, X509_free);
+    return error;
+}
+
+/**
+ * Adds the tokens of a PKCS12 file in the key index. The file is loaded
+ * when the token is used (see loadIndexedToken).
+ */
+static TokenError _backend_addIndexedFile(Backend *backend,
+                                          const KeyIndexEntry *entry,
+                                          const char *filename, void *tag) {
+    for (size_t i = 0; i < entry->certCount; i++) {
+        const KeyIndexCert *cert = &entry->certs[i];
+        if (!(cert->usages & (1 << backend->notifier->keyUsage))) continue;
+        
+        const unsigned char *der = (const unsigned char *)cert->subject;
+        X509_NAME *id = d2i_X509_NAME(NULL, &der, (long)cert->subjectLength);
+        if (!id) continue;
+        
+        PKCS12Token *token = NULL;
+        if (certutil_matchSubjectFilter(backend->notifier->subjectFilter, id)) {
+            token = calloc(1, sizeof(PKCS12Token));
+        }
+        if (token) {
+            token->filename = strdup(filename);
+        }
+        if (!token || !token->filename) {
+            free(token);
+            X509_NAME_free(id);
+            continue;
+        }
+        
+        token->base.backend = backend;
+        token->base.status = TokenStatus_NeedPassword;
+        token->base.displayName = certutil_getDisplayNameFromDN(id);
+        token->base.tag = tag;
+        token->subjectName = id;
+        token->indexedName = id;
+        backend->notifier->notifyFunction((Token*)token, TokenChange_Added);
+    }
+    return TokenError_Success;
+}
+
 /**
  * Returns a list of DER-BASE64 encoded certificates, from the subject
  * to the root CA.
@@ -273,6 +433,10 @@ static TokenError _backend_addFile(Backend *backend,
 static TokenError _backend_getBase64Chain(const PKCS12Token *token,
                                           char ***certs, size_t *count) {
     
+    // Tokens from the key index are loaded on first use
+    TokenError error = loadIndexedToken((PKCS12Token *)token);
+    if (error) return error;
+    
     STACK_OF(X509) *certList = pkcs12_listCerts(token->sharedP12->data);
     if (!certList) return TokenError_Unknown;
     
@@ -316,26 +480,43 @@ static TokenError _backend_sign(PKCS12Token *token,
     
     if (messagelen >= UINT_MAX) return TokenError_MessageTooLong;
     
-    // Find the certificate for the token
-    STACK_OF(X509) *certList = pkcs12_listCerts(token->sharedP12->data);
-    if (!certList) return TokenError_Unknown;
-    
-    X509 *cert = certutil_findCert(certList, token->subjectName,
-                                   token->base.backend->notifier->keyUsage,
-                                   false);
-    if (!cert) {
+    EVP_PKEY *key = token->key;
+    if (!key) {
+        TokenError error = loadIndexedToken(token);
+        if (error) return error;
+        
+        // Find the certificate for the token
+        STACK_OF(X509) *certList = pkcs12_listCerts(token->sharedP12->data);
+        if (!certList) return TokenError_Unknown;
+        
+        X509 *cert = certutil_findCert(certList, token->subjectName,
+                                       token->base.backend->notifier->keyUsage,
+                                       false);
+        if (!cert) {
+            sk_X509_pop_free(certList, X509_free);
+            return TokenError_Unknown;
+        }
+        
+        // Get the corresponding private key. This is the slow part
+        status_report(SignerStatus_UnlockingKey, 0);
+        int64_t traceStart = trace_begin();
+        key = getPrivateKey(token->sharedP12->data, cert,
+                            token->base.password);
+        trace_end("decrypt private key", traceStart);
         sk_X509_pop_free(certList, X509_free);
-        return TokenError_Unknown;
+        
+        if (!key) {
+            return (cancel_isRequested() ?
+                    TokenError_Cancelled : TokenError_BadPassword);
+        }
+        status_keyUnlocked();
+        
+        // Keep it for the following messages in a batch
+        if (token->base.keepKey) token->key = key;
     }
     
-    // Get the corresponding private key
-    EVP_PKEY *key = getPrivateKey(token->sharedP12->data, cert,
-                                  token->base.password);
-    sk_X509_pop_free(certList, X509_free);
-    
-    if (!key) return TokenError_BadPassword;
-    
     // Sign with the default crypto with SHA1
+    int64_t traceStart = trace_begin();
     unsigned int sig_len = EVP_PKEY_size(key);
     *siglen = sig_len;
     *signature = malloc(sig_len);
@@ -347,8 +528,9 @@ static TokenError _backend_sign(PKCS12Token *token,
                     EVP_SignFinal(&sig_ctx, (unsigned char*)*signature,
                                   &sig_len, key));
     EVP_MD_CTX_cleanup(&sig_ctx);
-    EVP_PKEY_free(key);
+    if (key != token->key) EVP_PKEY_free(key);
     *siglen = sig_len;
+    trace_end("RSA signature", traceStart);
     
     if (success) {
         return TokenError_Success;
@@ -488,6 +670,25 @@ static TokenError saveKeys(const CertReq *reqs, const char *hostname,
     return error;
 }
 
+typedef struct {
+    int primesFound;
+    int primesTotal;
+} KeygenProgress;
+
+/**
+ * Called by OpenSSL during key generation. Returning 0 aborts it.
+ */
+static int keygenCallback(int p, int n, BN_GENCB *cb) {
+    if (p == 3) {
+        // A prime has been found. There are two primes in each key.
+        KeygenProgress *progress = (KeygenProgress*)cb->arg;
+        progress->primesFound++;
+        status_report(SignerStatus_GeneratingKey,
+                      100 * progress->primesFound / progress->primesTotal);
+    }
+    return !cancel_isRequested();
+}
+
 TokenError _backend_createRequest(const RegutilInfo *info,
                                   const char *hostname,
                                   const char *password,
@@ -502,6 +703,14 @@ TokenError _backend_createRequest(const RegutilInfo *info,
     *request = NULL;
     if (!info->pkcs10) return TokenError_Unknown;
     
+    // Each key has two primes, for the progress reports
+    KeygenProgress progress = { 0, 0 };
+    for (const RegutilPKCS10 *pkcs10 = info->pkcs10; pkcs10 != NULL;
+         pkcs10 = pkcs10->next) {
+        progress.primesTotal += 2;
+    }
+    status_report(SignerStatus_GeneratingKey, 0);
+    
     // Create certificate requests
     bool ok = true;
     CertReq *reqs = NULL;
@@ -522,11 +731,18 @@ TokenError _backend_createRequest(const RegutilInfo *info,
             pkcs10->keySize > 16384)
             goto req_error;
         
-        // Generate key pair
-        // FIXME deprecated function
-        // TODO use OPENSSL_NO_DEPRECATED
-        rsa = RSA_generate_key(pkcs10->keySize, RSA_F4, NULL, NULL);
-        if (!rsa) goto req_error;
+        // Generate key pair. This can take a long time for large keys,
+        // so the callback checks for cancellation
+        BIGNUM *exponent = BN_new();
+        BN_GENCB keygenCb;
+        BN_GENCB_set(&keygenCb, keygenCallback, &progress);
+        rsa = RSA_new();
+        if (!exponent || !rsa || !BN_set_word(exponent, RSA_F4) ||
+            !RSA_generate_key_ex(rsa, pkcs10->keySize, exponent, &keygenCb)) {
+            BN_free(exponent);
+            goto req_error;
+        }
+        BN_free(exponent);
         privkey = EVP_PKEY_new();
         if (!privkey) goto req_error;
         EVP_PKEY_assign_RSA(privkey, rsa);
@@ -591,7 +807,8 @@ TokenError _backend_createRequest(const RegutilInfo *info,
         ok = false;
     }
     
-    TokenError error = TokenError_Unknown;
+    TokenError error = (!ok && cancel_isRequested() ?
+                        TokenError_Cancelled : TokenError_Unknown);
     
     if (ok) {
         // Determine filename from certificate name
@@ -841,11 +1058,16 @@ static const Backend backend_template = {
     .init = _backend_init,
     .free = _backend_free,
     .freeToken = _backend_freeToken,
+    .matchSubjectFilter = _backend_matchSubjectFilter,
+    .replaceToken = _backend_replaceToken,
     .addFile = _backend_addFile,
+    .indexFile = _backend_indexFile,
+    .addIndexedFile = _backend_addIndexedFile,
     .createRequest = _backend_createRequest,
     .storeCertificates = _backend_storeCertificates,
     .getBase64Chain = _backend_getBase64Chain,
     .sign = _backend_sign,
+    .releaseKey = _backend_releaseKey,
 };
 
 Backend *pkcs12_getBackend() {
@@ -39,6 +39,8 @@ void platform_seedRandom();
 /* Pipe I/O */
 typedef void (PlatformPipeFunction) ();
 void platform_setupPipe(PlatformPipeFunction *pipeFunction);
+void platform_watchPipe();
+void platform_unwatchPipe();
 
 /* File IO */
 typedef enum { Platform_OpenRead, Platform_OpenCreate } PlatformOpenMode;
@@ -47,6 +49,23 @@ bool platform_closeLocked(FILE *file);
 bool platform_deleteLocked(FILE *file, const char *filename);
 bool platform_readFile(const char *filename, char **data, int *length);
 
+typedef struct {
+    const char *data;
+    size_t length;
+    bool mapped;    // false if the file was read into memory instead
+    int fd;         // locked descriptor of a mapped file
+} PlatformFile;
+bool platform_mapFile(const char *filename, PlatformFile *file);
+void platform_unmapFile(PlatformFile *file);
+
+typedef struct {
+    const char *filename;
+    size_t length;      // expected length of the file
+    bool ok;
+    PlatformFile file;
+} PlatformFileRead;
+bool platform_readFiles(PlatformFileRead *reads, size_t count);
+
 typedef struct PlatformDirIter PlatformDirIter;
 PlatformDirIter *platform_openDir(const char *pathname);
 bool platform_iterateDir(PlatformDirIter *iter);
@@ -59,6 +78,10 @@ PlatformDirIter *platform_openKeysDir();
 char *platform_filterFilename(const char *filename);
 char *platform_getFilenameForKey(const char *nameAttr);
 
+typedef void (PlatformKeyFileFunction) (const char *filename);
+bool platform_watchKeyDirs(PlatformKeyFileFunction *function);
+void platform_unwatchKeyDirs();
+
 /* Configuration */
 char *platform_getConfigPath(const char *appname);
 
@@ -93,6 +116,7 @@ uint32_t platform_lookupTypeARecord(const char *hostname);
 
 void platform_mainloop();
 void platform_leaveMainloop();
+bool platform_hasUI();
 
 /* Signature dialog */
 void platform_startSign(const char *url, const char *hostname, const char *ip,
@@ -100,9 +124,9 @@ void platform_startSign(const char *url, const char *hostname, const char *ip,
 void platform_endSign();
 void platform_setNotifier(BackendNotifier *notifier);
 void platform_setMessage(const char *message);
-void platform_addKeyDirectories();
 void platform_addToken(Token *token);
 void platform_removeToken(Token *token);
+void platform_updateToken(Token *token);
 bool platform_sign(Token **token, char *password, int password_maxlen);
 
 /* Password selection (and key generation) dialog */
@@ -115,5 +139,33 @@ bool platform_choosePassword(char *password, long password_maxlen);
 void platform_showError(TokenError error);
 void platform_versionExpiredError();
 
+/* User interface module. The dialog functions above are implemented in a
+   module that is loaded when the first dialog is shown, so commands that
+   don't show any dialog don't have to load and initialize GTK. */
+typedef struct {
+    void (*startSign)(const char *url, const char *hostname, const char *ip,
+                      unsigned long parentWindowId);
+    void (*endSign)();
+    void (*setNotifier)(BackendNotifier *notifier);
+    void (*setMessage)(const char *message);
+    void (*addToken)(Token *token);
+    void (*removeToken)(Token *token);
+    void (*updateToken)(Token *token);
+    bool (*sign)(Token **token, char *password, int password_maxlen);
+    
+    void (*startChoosePassword)(const char *name,
+                                unsigned long parentWindowId);
+    void (*setPasswordPolicy)(int minLength, int minNonDigits,
+                              int minDigits);
+    void (*endChoosePassword)();
+    bool (*choosePassword)(char *password, long password_maxlen);
+    
+    void (*showError)(TokenError error);
+    void (*versionExpiredError)();
+} PlatformUI;
+
+#define PLATFORM_UI_ENTRY "platform_initUI"
+typedef const PlatformUI *(PlatformUIInitFunction) ();
+
 #endif
 
@@ -30,6 +30,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
@@ -41,6 +42,7 @@
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <limits.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
@@ -120,6 +122,99 @@ bool platform_readFile(const char *filename, char **data, int *length) {
     return ok;
 }
 
+// Files up to this size are read in completely when they are mapped
+#define MAP_POPULATE_MAX (64*1024)
+
+/**
+ * Reads the rest of a file into memory. Used when a file can't be mapped.
+ */
+static bool readIntoMemory(int fd, PlatformFile *file) {
+    char *data = malloc(file->length);
+    if (!data) return false;
+    
+    size_t done = 0;
+    while (done < file->length) {
+        ssize_t count = read(fd, data+done, file->length-done);
+        if (count == -1 && errno == EINTR) continue;
+        if (count <= 0) {
+            guaranteed_memset(data, 0, done);
+            free(data);
+            return false;
+        }
+        done += (size_t)count;
+    }
+    
+    file->data = data;
+    file->mapped = false;
+    return true;
+}
+
+/**
+ * Maps a file into memory for reading, so it can be parsed without being
+ * copied. The file is locked for reading, like in platform_readFile, and
+ * it stays locked until platform_unmapFile is called. This keeps programs
+ * that honor the lock from truncating the file while it's mapped, which
+ * would make reads from the mapping raise SIGBUS. If the file can't be
+ * mapped (for example on some network file systems), then it's read into
+ * memory instead.
+ */
+bool platform_mapFile(const char *filename, PlatformFile *file) {
+    file->data = NULL;
+    file->length = 0;
+    file->mapped = false;
+    file->fd = -1;
+    
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    
+    bool ok = false;
+    struct flock lk = file_lock(F_RDLCK);
+    struct stat st;
+    if (fcntl(fd, F_SETLKW, &lk) != 0 || fstat(fd, &st) != 0 ||
+        !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > INT_MAX) {
+        goto end;
+    }
+    file->length = (size_t)st.st_size;
+    
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if (file->length <= MAP_POPULATE_MAX) flags |= MAP_POPULATE;
+#endif
+    void *data = mmap(NULL, file->length, PROT_READ, flags, fd, 0);
+    if (data != MAP_FAILED) {
+        if (file->length > MAP_POPULATE_MAX) {
+            posix_madvise(data, file->length, POSIX_MADV_WILLNEED);
+        }
+        file->data = data;
+        file->mapped = true;
+        file->fd = fd;
+        return true;
+    }
+    ok = readIntoMemory(fd, file);
+    
+  end:
+    // This also releases the lock
+    close(fd);
+    if (!ok) file->length = 0;
+    return ok;
+}
+
+void platform_unmapFile(PlatformFile *file) {
+    if (!file->data) return;
+    if (file->mapped) {
+        munmap((void *)file->data, file->length);
+        
+        // This also releases the lock
+        close(file->fd);
+        file->fd = -1;
+    } else {
+        guaranteed_memset((char *)file->data, 0, file->length);
+        free((char *)file->data);
+    }
+    file->data = NULL;
+    file->length = 0;
+}
+
 PlatformDirIter *platform_openDir(const char *pathname) {
     PlatformDirIter *iter = malloc(sizeof(PlatformDirIter));
     if (!iter) return NULL;
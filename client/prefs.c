@@ -22,6 +22,10 @@
 
 */
 
+#include <stdlib.h>
+
+#include <glib.h>
+
 #include "../common/defines.h"
 #include "platform.h"
 
@@ -31,22 +35,39 @@ const char *prefs_pkcs11_module = DEFAULT_PKCS11_MODULE;
 const char *prefs_bankid_emulatedversion = NULL;
 
 /**
- * Loads the preferences from ~/.config/fribid/config
+ * Returns a copy of a string from the configuration that is never freed.
+ * The preferences may be loaded again while the old values are still in
+ * use, and each distinct value is only stored once.
+ */
+static const char *keepString(char *s) {
+    const char *kept = g_intern_string(s);
+    free(s);
+    return kept;
+}
+
+/**
+ * Loads the preferences from ~/.config/fribid/config. This may be called
+ * again to reload them.
  */
 void prefs_load() {
+#if ENABLE_PKCS11
+    prefs_pkcs11_module = DEFAULT_PKCS11_MODULE;
+#endif
+    prefs_bankid_emulatedversion = NULL;
+    
     PlatformConfig *cfg = platform_openConfig("fribid", "config");
     if (cfg) {
         char *s;
         /* Which PKCS#11 module to use */
 #if ENABLE_PKCS11
         if (platform_getConfigString(cfg, "pkcs11", "module", &s)) {
-            prefs_pkcs11_module = s;
+            prefs_pkcs11_module = keepString(s);
         }
 #endif
         
         /* Which BankID client software version to report */
         if (platform_getConfigString(cfg, "expiry", "version-to-emulate", &s)) {
-            prefs_bankid_emulatedversion = s;
+            prefs_bankid_emulatedversion = keepString(s);
         }
         
         platform_freeConfig(cfg);
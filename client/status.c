@@ -0,0 +1,57 @@
+/*
+
+  Copyright (c) 2026 Samuel Lidén Borell <samuel@kodafritt.se>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+  
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+*/
+
+#include <stdlib.h>
+
+#include "status.h"
+
+/*
+  Progress reporting. The status is sent to the plugin as it changes, so
+  the web page can show what the signer is doing.
+*/
+
+static StatusFunction statusFunction = NULL;
+static int currentItem = 0;
+
+void status_setFunction(StatusFunction function) {
+    statusFunction = function;
+}
+
+/**
+ * Reports the progress of the current command.
+ */
+void status_report(SignerStatus status, int value) {
+    if (status == SignerStatus_Signing) currentItem = value;
+    if (statusFunction) statusFunction(status, value);
+}
+
+/**
+ * Called by backends after SignerStatus_UnlockingKey, when the key has
+ * been unlocked and signing of the current item continues.
+ */
+void status_keyUnlocked(void) {
+    status_report(SignerStatus_Signing, currentItem);
+}
+
+
@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Measures the startup time of the signer for a command that doesn't show
+# a dialog (GetVersion). Each call starts a new signer process, like the
+# plugin does when there's no idle signer.
+#
+# Usage: ./versiontime.sh [number of calls]
+#
+
+sendint() { echo "$*;"; }
+sendstring() { echo "${#1};$1"; }
+
+GetVersionCommand() { sendint 1; }
+
+count=${1:-100}
+
+start=`date +%s%N`
+i=0
+while [ $i -lt $count ]; do
+    {
+    # Send command header
+    GetVersionCommand
+    sendstring 'https://example.com/'  # URL
+    sendstring 'example.com'           # Hostname
+    sendstring '198.51.100.200'        # IP of example.com
+    } | ./sign --internal--ipc=10 > /dev/null
+    i=$((i+1))
+done
+end=`date +%s%N`
+
+echo "$count calls, `expr \( $end - $start \) / $count / 1000` us per call"
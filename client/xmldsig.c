@@ -33,13 +33,17 @@
 #include "xmldsig.h"
 #include "misc.h"
 
-static const char xmldsig_template[] = 
+// The signed data is inserted between the head and the tail
+static const char xmldsig_head_template[] =
     "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>"
     "<Signature xmlns=\"http://www.w3.org/2000/09/xmldsig#\">"
         "%s"
         "<SignatureValue>%s</SignatureValue>"
         "%s"
-        "<Object>%s</Object>"
+        "<Object>";
+
+static const char xmldsig_tail[] =
+        "</Object>"
     "</Signature>";
 
 static const char signedinfo_template[] =
@@ -74,13 +78,17 @@ static const char cert_template[] =
     "<X509Certificate>%s</X509Certificate>";
 
 /**
- * Creates a xmldsig signature. See the sign function in bankid.c.
+ * Creates a xmldsig signature, and returns it encoded with Base64. The
+ * data is given in pieces, so large messages don't have to be copied.
+ * See the sign function in bankid.c.
  */
-char *xmldsig_sign(Token *token, const char *dataId, const char *data) {
+char *xmldsig_sign(Token *token, const char *dataId,
+                   const StringPiece *data, size_t dataCount) {
     
     char **certs = NULL;
     char *keyinfo = NULL, *signedinfo = NULL;
     char *complete = NULL;
+    StringPiece *pieces = NULL;
     size_t certCount;
     
     // Keyinfo
@@ -111,7 +119,7 @@ char *xmldsig_sign(Token *token, const char *dataId, const char *data) {
     if (!keyinfo) goto error;
     
     // SignedInfo
-    char *data_sha = sha_base64(data);
+    char *data_sha = sha_base64_pieces(data, dataCount);
     char *keyinfo_sha = sha_base64(keyinfo);
     
     if (data_sha && keyinfo_sha) {
@@ -134,14 +142,29 @@ char *xmldsig_sign(Token *token, const char *dataId, const char *data) {
     free(sigData);
     if (!signature) goto error;
     
-    // Glue everything together
-    complete = rasprintf(xmldsig_template,
-                         signedinfo, signature, keyinfo, data);
-    
+    // Glue everything together and encode it
+    char *head = rasprintf(xmldsig_head_template,
+                           signedinfo, signature, keyinfo);
     free(signature);
+    if (!head) goto error;
+    
+    if (dataCount > SIZE_T_MAX / sizeof(StringPiece) - 2) goto error;
+    pieces = malloc((dataCount + 2) * sizeof(StringPiece));
+    if (pieces) {
+        pieces[0].data = head;
+        pieces[0].length = strlen(head);
+        memcpy(&pieces[1], data, dataCount * sizeof(StringPiece));
+        pieces[dataCount+1].data = xmldsig_tail;
+        pieces[dataCount+1].length = strlen(xmldsig_tail);
+        
+        complete = base64_encode_pieces(pieces, dataCount + 2);
+    }
+    
+    free(head);
     
   error:
     // Clean up
+    free(pieces);
     free(signedinfo);
     free(keyinfo);
     certutil_freeList(&certs, &certCount);
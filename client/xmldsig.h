@@ -26,8 +26,10 @@
 #define XMLDSIG_H
 
 #include "backend.h"
+#include "misc.h"
 
-char *xmldsig_sign(Token *token, const char *dataId, const char *data);
+char *xmldsig_sign(Token *token, const char *dataId,
+                   const StringPiece *data, size_t dataCount);
 
 #endif
 
@@ -40,6 +40,9 @@ typedef enum {
     BIDERR_HostnameIsIP =     8019,
     BIDERR_BlockedPIN =       8102,
     
+    // FriBID extension: the request was cancelled or the deadline passed
+    BIDERR_Timeout =          9001,
+    
     // Errors from regutil
     RUERR_InvalidParameter =   640,
     RUERR_InvalidValue =      1028,
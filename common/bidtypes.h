@@ -59,5 +59,32 @@ typedef struct {
     RegutilCMC cmc;
 } RegutilInfo;
 
+// batch signing (FriBID extension)
+typedef struct SignBatchItem {
+    struct SignBatchItem *next;
+    
+    char *challenge;
+    char *message;
+    char *invisibleMessage;
+} SignBatchItem;
+
+#define MAX_BATCH_ITEMS 100
+// The whole batch is sent to the signer in one frame, and the signatures
+// (which contain the messages) are returned in one frame. This limit
+// leaves room for both within the frame size limit (see pipe.c)
+#define MAX_BATCH_LENGTH (32*1024*1024)
+
+// progress of a command in the signer (FriBID extension)
+typedef enum {
+    SignerStatus_None = 0,
+    SignerStatus_Started,       // the command has been sent
+    SignerStatus_DialogShown,
+    SignerStatus_TokensFound,   // value = number of tokens
+    SignerStatus_UnlockingKey,
+    SignerStatus_GeneratingKey, // value = percent done
+    SignerStatus_Signing,       // value = index of the item in a batch
+    SignerStatus_Done,          // the reply has been received
+} SignerStatus;
+
 #endif
 
@@ -37,7 +37,8 @@
 
 #define BINNAME             "fribid"
 #define RELEASE_TIME        1391205036
-#define IPCVERSION          "10"
+#define IPCVERSION          "12"
+#define IPCVERSION_TEXT     "10"
 
 #define EMULATED_VERSION    "4.15.0.14"
 #define DNSVERSION          "2"
@@ -51,6 +52,7 @@
 #define SIGNING_EXECUTABLE  LIBEXEC_PATH "/sign"
 #define UI_PATH             SHARE_PATH "/ui"
 #define UI_GTK_XML          UI_PATH "/sign.xml"
+#define UI_GTK_MODULE       LIB_PATH "/sign-gtk.so"
 #define NPAPI_PLUGIN_LIB    LIB_PATH "/libfribidplugin.so"
 
 #endif
@@ -23,17 +23,32 @@
 */
 
 #define _BSD_SOURCE 1
+#define _GNU_SOURCE 1
 #define _POSIX_C_SOURCE 200112
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <glib.h>
 
 #include "../common/defines.h"
 #include "../common/pipe.h"
 
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING) && defined(F_ADD_SEALS)
+#   define HAVE_MEMFD 1
+#endif
+
 #if defined(FRIBID_CLIENT)
 #   define PIPE_ERROR_STRING ": pipe error in client\n"
 #elif defined(FRIBID_PLUGIN)
@@ -46,54 +61,1513 @@ static void pipeError() {
     fprintf(stderr, BINNAME PIPE_ERROR_STRING);
 }
 
-static gboolean stopWaiting(GIOChannel *source,
-                            GIOCondition condition, gpointer data) {
-    *((bool*)data) = true;
-    return FALSE;
+/*
+  Framed protocol (IPC version 12)
+  
+  All data is sent in frames with a fixed size header:
+  
+      uint32  payload length
+      uint16  frame type (PipeFrameType)
+      uint16  flags (always zero for now)
+      uint32  request id
+  
+  The payload consists of fields: integers are sent as int32, and strings
+  are sent as a uint32 length followed by the data and a null terminator
+  (which isn't included in the length). 64-bit values, such as the window
+  id, are sent as two int32 with the most significant half first. All
+  numbers are little-endian.
+  
+  Both sides start by sending a HELLO frame with the protocol version and
+  the features they support. The plugin sends requests, and the signer
+  replies with one or more response frames.
+  
+  Replies and status frames have the request id of the request. With the
+  PF_Multiplex feature, the plugin may send a request for a command that
+  doesn't show a dialog while another request is running, and the replies
+  may then arrive in any order. The receiver keeps frames for other
+  requests until they are read (see pipe_waitReply).
+  
+  With the PF_Status feature, the signer may send status frames while it's
+  processing a request, with the current SignerStatus and a value as
+  int32 fields. Status frames may appear between any two frames, even in
+  the middle of a reply, and are handled separately by the receiver.
+  
+  With the PF_TraceId feature, the common part of each command ends with
+  the correlation id of the trace spans for the command (see trace.c).
+  
+  If the PF_FdPassing feature is used, then the streams are a Unix domain
+  socket, and large strings are sent in a sealed memfd instead. The
+  length of such strings has FIELD_IN_FD set, there's no data in the
+  frame, and the descriptor is attached to the frame with SCM_RIGHTS.
+  
+  The text protocol (IPC version 10) is used for streams that haven't
+  been set up with pipe_initFramed.
+*/
+
+/*
+  Transcripts (see pipe_record)
+  
+  The frames of a channel can be recorded to a file, which starts with
+  the 8 bytes "FBIDREC1" followed by a record for each frame:
+  
+      uint32  session id (one for each recorded channel)
+      uint32  direction (PipeRecordDirection)
+      uint64  time in microseconds (monotonic clock)
+      ...     the frame header and payload, as sent on the stream
+  
+  Several processes may append to the same file, since each record is
+  written with a single write call. Large strings aren't sent in a memfd
+  on recorded channels, so the transcript contains all data.
+*/
+
+typedef enum {
+    PFT_Hello = 1,
+    PFT_Request,
+    PFT_Response,
+    PFT_Status,
+} PipeFrameType;
+
+#define FRAME_HEADER_SIZE  12
+#define FRAME_MAX_LENGTH   (64*1024*1024)
+#define FRAMED_VERSION     12
+// Strings shorter than this are copied into the frame buffer
+#define FRAME_COPY_LIMIT   256
+// Strings of at least this size are sent in a memfd, if possible
+#define FRAME_FD_LIMIT     (256*1024)
+#define FRAME_MAX_FDS      8
+// Number of abandoned requests whose replies are discarded
+#define FRAME_MAX_DROPPED  8
+#define FIELD_IN_FD        0x80000000u
+
+#define RECORD_MAGIC       "FBIDREC1"
+#define RECORD_HEADER_SIZE 16
+
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+// Part of a frame that is being sent. The data is either a buffer that is
+// owned by the caller, or a part of the frame buffer (if data is NULL).
+typedef struct {
+    const char *data;
+    size_t offset;
+    size_t length;
+} PipeTxPiece;
+
+// Received frame that is kept until its reply is read
+typedef struct PipeFrame {
+    struct PipeFrame *next;
+    PipeFrameType type;
+    uint32_t requestId;
+    char *data;
+    size_t length;
+    int fds[FRAME_MAX_FDS];
+    size_t fdCount;
+} PipeFrame;
+
+typedef struct PipeChannel {
+    struct PipeChannel *next;
+    FILE *in;
+    FILE *out;
+    unsigned int features;
+    // Id of sent requests (plugin) or of the request being replied to
+    uint32_t requestId;
+    
+    // Frame being sent. Caller-owned data must be valid until the frame
+    // is sent with pipe_flush or pipe_finishCommand.
+    PipeFrameType txType;
+    char *txData;
+    size_t txDataLength, txCapacity;
+    PipeTxPiece *txPieces;
+    size_t txPieceCount, txPieceCapacity;
+    size_t txLength;
+    struct iovec *txIov;
+    bool txFailed;
+    int txFds[FRAME_MAX_FDS];
+    size_t txFdCount;
+    
+    // Frame being read
+    PipeFrameType rxType;
+    uint32_t rxRequestId;
+    char *rxData;
+    size_t rxLength, rxPos;
+    bool rxLoaded;
+    
+    // Replies to other requests than readingId are kept here
+    bool hasReadingId;
+    uint32_t readingId;
+    PipeFrame *stash;
+    
+    // Replies to these requests are discarded (see pipe_dropReply)
+    uint32_t droppedIds[FRAME_MAX_DROPPED];
+    size_t droppedCount, droppedNext;
+    
+    // Frame being received by pipe_receive
+    bool nonBlocking;
+    bool partialHasHeader;
+    char partialHeader[FRAME_HEADER_SIZE];
+    char *partialData;
+    size_t partialLength, partialReceived;
+    
+    // Receiver of status frames
+    PipeStatusFunction statusFunction;
+    void *statusData;
+    
+    // Set when the other side has closed the stream, or when reading or
+    // writing has failed. The stdio flags aren't set since stdio isn't used.
+    bool rxEnd;
+    bool failed;
+    
+    // Descriptors that have been received but not read yet
+    bool isSocket;
+    int rxFds[FRAME_MAX_FDS];
+    size_t rxFdCount;
+    
+    // Transcript file (see pipe_record)
+    bool recording;
+    int recordFd;
+    uint32_t recordSession;
+} PipeChannel;
+
+static PipeChannel *channels = NULL;
+
+// Strings that are mapped from a memfd (see pipe_readLargeString)
+typedef struct PipeMapping {
+    struct PipeMapping *next;
+    char *data;
+    size_t size;
+} PipeMapping;
+
+static PipeMapping *mappings = NULL;
+
+static PipeChannel *findChannel(FILE *file) {
+    for (PipeChannel *channel = channels; channel; channel = channel->next) {
+        if (channel->in == file || channel->out == file) return channel;
+    }
+    return NULL;
+}
+
+/**
+ * Makes the given pair of streams use the framed protocol.
+ */
+void pipe_initFramed(FILE *in, FILE *out) {
+    PipeChannel *channel = calloc(1, sizeof(PipeChannel));
+    if (!channel) {
+        pipeError();
+        return;
+    }
+    channel->in = in;
+    channel->out = out;
+    channel->txType = PFT_Response;
+    
+    struct stat st;
+    channel->isSocket = (fstat(fileno(in), &st) == 0 && S_ISSOCK(st.st_mode));
+    
+    channel->next = channels;
+    channels = channel;
+}
+
+static void closeFds(int *fds, size_t *count) {
+    while (*count > 0) {
+        close(fds[--*count]);
+    }
+}
+
+/**
+ * Closes a pair of streams, and frees the protocol state.
+ */
+void pipe_close(FILE *in, FILE *out) {
+    for (PipeChannel **link = &channels; *link; link = &(*link)->next) {
+        PipeChannel *channel = *link;
+        if (channel->in == in) {
+            *link = channel->next;
+            free(channel->txData);
+            free(channel->txPieces);
+            free(channel->txIov);
+            free(channel->rxData);
+            free(channel->partialData);
+            closeFds(channel->txFds, &channel->txFdCount);
+            closeFds(channel->rxFds, &channel->rxFdCount);
+            if (channel->recording) close(channel->recordFd);
+            while (channel->stash) {
+                PipeFrame *frame = channel->stash;
+                channel->stash = frame->next;
+                free(frame->data);
+                closeFds(frame->fds, &frame->fdCount);
+                free(frame);
+            }
+            free(channel);
+            break;
+        }
+    }
+    fclose(out);
+    fclose(in);
+}
+
+static void putUInt32(char *p, uint32_t value) {
+    p[0] = (char)(value & 0xFF);
+    p[1] = (char)((value >> 8) & 0xFF);
+    p[2] = (char)((value >> 16) & 0xFF);
+    p[3] = (char)((value >> 24) & 0xFF);
+}
+
+static void putUInt16(char *p, uint16_t value) {
+    p[0] = (char)(value & 0xFF);
+    p[1] = (char)((value >> 8) & 0xFF);
+}
+
+static uint32_t getUInt32(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return (uint32_t)u[0] | ((uint32_t)u[1] << 8) |
+           ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+static uint16_t getUInt16(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return (uint16_t)(u[0] | (u[1] << 8));
+}
+
+/**
+ * Appends a frame to the transcript, if the channel is recorded.
+ */
+static void frameRecord(PipeChannel *channel, PipeRecordDirection direction,
+                        const struct iovec *iov, size_t count) {
+    if (!channel->recording) return;
+    
+    size_t length = RECORD_HEADER_SIZE;
+    for (size_t i = 0; i < count; i++) length += iov[i].iov_len;
+    
+    char *record = malloc(length);
+    if (!record) return;
+    
+    uint64_t time = (uint64_t)g_get_monotonic_time();
+    putUInt32(&record[0], channel->recordSession);
+    putUInt32(&record[4], direction);
+    putUInt32(&record[8], (uint32_t)(time & 0xFFFFFFFF));
+    putUInt32(&record[12], (uint32_t)(time >> 32));
+    
+    char *p = &record[RECORD_HEADER_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    
+    if (write(channel->recordFd, record, length) != (ssize_t)length) {
+        fprintf(stderr, BINNAME ": failed to write IPC transcript\n");
+        close(channel->recordFd);
+        channel->recording = false;
+    }
+    free(record);
+}
+
+static void frameRecordReceived(PipeChannel *channel, const char *header,
+                                const char *data, size_t length) {
+    struct iovec iov[2] = {
+        { (void *)header, FRAME_HEADER_SIZE },
+        { (void *)data, length },
+    };
+    frameRecord(channel, PRD_Received, iov, 2);
+}
+
+static PipeTxPiece *frameAddPiece(PipeChannel *channel) {
+    if (channel->txPieceCount == channel->txPieceCapacity) {
+        size_t capacity = (channel->txPieceCapacity ?
+                           channel->txPieceCapacity*2 : 16);
+        PipeTxPiece *pieces = realloc(channel->txPieces,
+                                      capacity*sizeof(PipeTxPiece));
+        struct iovec *iov = realloc(channel->txIov,
+                                    (capacity+1)*sizeof(struct iovec));
+        if (pieces) channel->txPieces = pieces;
+        if (iov) channel->txIov = iov;
+        if (!pieces || !iov) return NULL;
+        channel->txPieceCapacity = capacity;
+    }
+    return &channel->txPieces[channel->txPieceCount++];
+}
+
+/**
+ * Adds data to the frame buffer and returns a pointer to it.
+ */
+static char *frameAppend(PipeChannel *channel, size_t length) {
+    if (channel->txCapacity - channel->txDataLength < length) {
+        size_t capacity = (channel->txCapacity ? channel->txCapacity : 256);
+        while (capacity - channel->txDataLength < length) capacity *= 2;
+        
+        char *data = realloc(channel->txData, capacity);
+        if (!data) goto error;
+        channel->txData = data;
+        channel->txCapacity = capacity;
+    }
+    
+    // Extend the last piece if it's also in the frame buffer
+    PipeTxPiece *last = (channel->txPieceCount ?
+                         &channel->txPieces[channel->txPieceCount-1] : NULL);
+    if (last && !last->data) {
+        last->length += length;
+    } else {
+        PipeTxPiece *piece = frameAddPiece(channel);
+        if (!piece) goto error;
+        piece->data = NULL;
+        piece->offset = channel->txDataLength;
+        piece->length = length;
+    }
+    
+    char *p = channel->txData + channel->txDataLength;
+    channel->txDataLength += length;
+    channel->txLength += length;
+    return p;
+    
+  error:
+    pipeError();
+    channel->txFailed = true;
+    return NULL;
+}
+
+/**
+ * Adds a caller-owned buffer to the frame, without copying it.
+ */
+static void frameAddBuffer(PipeChannel *channel, const char *data,
+                           size_t length) {
+    PipeTxPiece *piece = frameAddPiece(channel);
+    if (!piece) {
+        pipeError();
+        channel->txFailed = true;
+        return;
+    }
+    piece->data = data;
+    piece->length = length;
+    channel->txLength += length;
+}
+
+static void frameAddInt(PipeChannel *channel, int value) {
+    char *p = frameAppend(channel, 4);
+    if (p) putUInt32(p, (uint32_t)value);
+}
+
+/**
+ * Writes all data, handling partial writes. The iovec array is modified.
+ */
+static bool writeAll(int fd, struct iovec *iov, size_t count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, (count > IOV_MAX ? IOV_MAX : count));
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        
+        // Skip the data that was written
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+/**
+ * Sends a string in a sealed memfd. Returns false if the string should
+ * be sent in the frame instead.
+ */
+static bool frameAddMemfd(PipeChannel *channel, const char *data,
+                          size_t length) {
+#ifdef HAVE_MEMFD
+    if (!(channel->features & PF_FdPassing) || length < FRAME_FD_LIMIT ||
+        channel->txFdCount == FRAME_MAX_FDS) {
+        return false;
+    }
+    
+    int fd = memfd_create(BINNAME, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) return false;
+    
+    struct iovec iov[2] = {
+        { (void *)data, length },
+        { (void *)"", 1 },
+    };
+    if (!writeAll(fd, iov, 2) ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+                               F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+        close(fd);
+        return false;
+    }
+    
+    char *p = frameAppend(channel, 4);
+    if (!p) {
+        close(fd);
+        return true;
+    }
+    putUInt32(p, (uint32_t)length | FIELD_IN_FD);
+    channel->txFds[channel->txFdCount++] = fd;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Adds a string field. If the data is null terminated, then the
+ * terminator is sent from the caller's buffer too.
+ */
+static void frameAddData(PipeChannel *channel, const char *data,
+                         size_t length, bool terminated) {
+    if (frameAddMemfd(channel, data, length)) return;
+    
+    char *p = frameAppend(channel, 4);
+    if (!p) return;
+    putUInt32(p, (uint32_t)length);
+    
+    if (length < FRAME_COPY_LIMIT) {
+        p = frameAppend(channel, length+1);
+        if (!p) return;
+        memcpy(p, data, length);
+        p[length] = '\0';
+    } else if (terminated) {
+        frameAddBuffer(channel, data, length+1);
+    } else {
+        frameAddBuffer(channel, data, length);
+        p = frameAppend(channel, 1);
+        if (p) *p = '\0';
+    }
+}
+
+/**
+ * Sends data over a socket, along with the given descriptors.
+ */
+static bool sendAll(int fd, struct iovec *iov, size_t count,
+                    const int *fds, size_t fdCount) {
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(FRAME_MAX_FDS*sizeof(int))];
+    } control;
+    
+    while (count > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (count > IOV_MAX ? IOV_MAX : count);
+        
+        if (fdCount) {
+            // The descriptors are attached to the first part of the frame
+            msg.msg_control = control.data;
+            msg.msg_controllen = CMSG_SPACE(fdCount*sizeof(int));
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(fdCount*sizeof(int));
+            memcpy(CMSG_DATA(cmsg), fds, fdCount*sizeof(int));
+        }
+        
+        ssize_t written = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        fdCount = 0;
+        
+        // Skip the data that was written
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+/**
+ * Sends the frame that has been built, if any, with a single writev
+ * call (unless the frame is very large or the pipe is full).
+ */
+static void frameSend(PipeChannel *channel) {
+    char header[FRAME_HEADER_SIZE];
+    
+    if (channel->txPieceCount == 0 && !channel->txFailed) return;
+    
+    if (!channel->txFailed) {
+        putUInt32(&header[0], (uint32_t)channel->txLength);
+        putUInt16(&header[4], (uint16_t)channel->txType);
+        putUInt16(&header[6], 0);
+        putUInt32(&header[8], channel->requestId);
+        
+        struct iovec *iov = channel->txIov;
+        iov[0].iov_base = header;
+        iov[0].iov_len = FRAME_HEADER_SIZE;
+        for (size_t i = 0; i < channel->txPieceCount; i++) {
+            const PipeTxPiece *piece = &channel->txPieces[i];
+            iov[i+1].iov_base = (void *)(piece->data ? piece->data :
+                                         channel->txData + piece->offset);
+            iov[i+1].iov_len = piece->length;
+        }
+        frameRecord(channel, PRD_Sent, iov, channel->txPieceCount+1);
+        
+        bool ok;
+        if (channel->isSocket) {
+            ok = sendAll(fileno(channel->out), iov, channel->txPieceCount+1,
+                         channel->txFds, channel->txFdCount);
+        } else {
+            ok = writeAll(fileno(channel->out), iov, channel->txPieceCount+1);
+        }
+        if (!ok) {
+            pipeError();
+            channel->failed = true;
+        }
+    }
+    
+    // The receiver has its own copies of the descriptors
+    closeFds(channel->txFds, &channel->txFdCount);
+    
+    channel->txPieceCount = 0;
+    channel->txDataLength = 0;
+    channel->txLength = 0;
+    channel->txFailed = false;
+    channel->txType = PFT_Response;
+}
+
+/**
+ * Parses a frame header, and returns the payload length.
+ */
+static bool frameParseHeader(PipeChannel *channel, const char *header,
+                             uint32_t *length) {
+    *length = getUInt32(&header[0]);
+    channel->rxType = getUInt16(&header[4]);
+    channel->rxRequestId = getUInt32(&header[8]);
+    if (*length > FRAME_MAX_LENGTH) {
+        pipeError();
+        channel->failed = true;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Takes the descriptors that were received with a message.
+ */
+static void takeFds(PipeChannel *channel, struct msghdr *msg) {
+    if (msg->msg_flags & MSG_CTRUNC) pipeError();
+    
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg;
+         cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i*sizeof(int), sizeof(int));
+            if (channel->rxFdCount < FRAME_MAX_FDS) {
+                channel->rxFds[channel->rxFdCount++] = fd;
+            } else {
+                pipeError();
+                close(fd);
+            }
+        }
+    }
+}
+
+/**
+ * Records the end of the stream or an error (see pipe_hasError).
+ */
+static ssize_t channelCheckRead(PipeChannel *channel, ssize_t count) {
+    if (count == 0) {
+        channel->rxEnd = true;
+    } else if (count < 0 && errno != EINTR && errno != EAGAIN &&
+               errno != EWOULDBLOCK) {
+        channel->failed = true;
+    }
+    return count;
+}
+
+/**
+ * Reads data from the input stream of a framed channel. The stdio buffer
+ * isn't used, since descriptors can't be received with stdio.
+ */
+static ssize_t channelRead(PipeChannel *channel, char *buffer,
+                           size_t length, bool wait) {
+    int fd = fileno(channel->in);
+    if (!channel->isSocket) {
+        return channelCheckRead(channel, read(fd, buffer, length));
+    }
+    
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(FRAME_MAX_FDS*sizeof(int))];
+    } control;
+    struct iovec iov = { buffer, length };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof(control.data);
+    
+    ssize_t count = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC |
+                                      (wait ? 0 : MSG_DONTWAIT));
+    if (count > 0) takeFds(channel, &msg);
+    return channelCheckRead(channel, count);
+}
+
+/**
+ * Reads exactly the given number of bytes, waiting if necessary.
+ */
+static bool channelReadAll(PipeChannel *channel, char *buffer,
+                           size_t length) {
+    while (length > 0) {
+        ssize_t count = channelRead(channel, buffer, length, true);
+        if (count == 0) return false;
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buffer += count;
+        length -= count;
+    }
+    return true;
+}
+
+/**
+ * Reads the next frame, of any type. Returns false at the end of the
+ * stream. Streams that are read with pipe_receive must not use this
+ * function.
+ */
+static bool frameLoadAny(PipeChannel *channel) {
+    char header[FRAME_HEADER_SIZE];
+    uint32_t length;
+    
+    channel->rxLoaded = false;
+    channel->rxLength = 0;
+    channel->rxPos = 0;
+    
+    if (channel->nonBlocking) return false;
+    
+    if (!channelReadAll(channel, header, FRAME_HEADER_SIZE) ||
+        !frameParseHeader(channel, header, &length)) {
+        return false;
+    }
+    
+    char *data = realloc(channel->rxData, length ? length : 1);
+    if (!data) {
+        pipeError();
+        channel->failed = true;
+        return false;
+    }
+    channel->rxData = data;
+    
+    if (length && !channelReadAll(channel, data, length)) {
+        pipeError();
+        channel->failed = true;
+        return false;
+    }
+    frameRecordReceived(channel, header, data, length);
+    
+    channel->rxLength = length;
+    channel->rxLoaded = true;
+    return true;
+}
+
+/**
+ * Passes a status frame to the status function.
+ */
+static void frameHandleStatus(PipeChannel *channel) {
+    int status = -1, value = 0;
+    if (channel->rxLength >= 8) {
+        status = (int)getUInt32(&channel->rxData[0]);
+        value = (int)getUInt32(&channel->rxData[4]);
+    }
+    channel->rxPos = channel->rxLength;
+    
+    if (status != -1 && channel->statusFunction) {
+        channel->statusFunction(channel->rxRequestId, status, value,
+                                channel->statusData);
+    }
+}
+
+/**
+ * Keeps the current frame until its reply is read. Descriptors that were
+ * received with the frame are kept with it.
+ */
+static void frameStash(PipeChannel *channel, size_t firstFd) {
+    PipeFrame *frame = calloc(1, sizeof(PipeFrame));
+    if (!frame) {
+        pipeError();
+        return;
+    }
+    frame->type = channel->rxType;
+    frame->requestId = channel->rxRequestId;
+    frame->data = channel->rxData;
+    frame->length = channel->rxLength;
+    frame->fdCount = channel->rxFdCount - firstFd;
+    memcpy(frame->fds, &channel->rxFds[firstFd], frame->fdCount*sizeof(int));
+    channel->rxFdCount = firstFd;
+    
+    channel->rxData = NULL;
+    channel->rxLength = 0;
+    channel->rxPos = 0;
+    channel->rxLoaded = false;
+    
+    PipeFrame **last = &channel->stash;
+    while (*last) last = &(*last)->next;
+    *last = frame;
+}
+
+/**
+ * Makes the first kept frame for readingId the current frame.
+ */
+static bool frameUnstash(PipeChannel *channel) {
+    for (PipeFrame **link = &channel->stash; *link; link = &(*link)->next) {
+        PipeFrame *frame = *link;
+        if (frame->requestId != channel->readingId) continue;
+        
+        *link = frame->next;
+        free(channel->rxData);
+        channel->rxType = frame->type;
+        channel->rxRequestId = frame->requestId;
+        channel->rxData = frame->data;
+        channel->rxLength = frame->length;
+        channel->rxPos = 0;
+        channel->rxLoaded = true;
+        for (size_t i = 0; i < frame->fdCount; i++) {
+            if (channel->rxFdCount < FRAME_MAX_FDS) {
+                channel->rxFds[channel->rxFdCount++] = frame->fds[i];
+            } else {
+                close(frame->fds[i]);
+            }
+        }
+        free(frame);
+        return true;
+    }
+    return false;
+}
+
+static bool frameIsStashed(const PipeChannel *channel, uint32_t requestId) {
+    for (const PipeFrame *frame = channel->stash; frame; frame = frame->next) {
+        if (frame->requestId == requestId) return true;
+    }
+    return false;
+}
+
+static bool frameIsDropped(const PipeChannel *channel, uint32_t requestId) {
+    for (size_t i = 0; i < channel->droppedCount; i++) {
+        if (channel->droppedIds[i] == requestId) return true;
+    }
+    return false;
+}
+
+/**
+ * Discards the current frame, and the descriptors that were received
+ * with it.
+ */
+static void frameDrop(PipeChannel *channel, size_t firstFd) {
+    size_t fdCount = channel->rxFdCount - firstFd;
+    closeFds(&channel->rxFds[firstFd], &fdCount);
+    channel->rxFdCount = firstFd;
+    
+    free(channel->rxData);
+    channel->rxData = NULL;
+    channel->rxLength = 0;
+    channel->rxPos = 0;
+    channel->rxLoaded = false;
+}
+
+/**
+ * Reads the next frame of the reply that is being read. Status frames are
+ * handled here, and replies to other requests are kept for later.
+ * Returns false at the end of the stream.
+ */
+static bool frameLoadNext(PipeChannel *channel, bool *stashed) {
+    if (channel->hasReadingId && frameUnstash(channel)) return true;
+    
+    size_t firstFd = channel->rxFdCount;
+    if (!frameLoadAny(channel)) return false;
+    
+    if (channel->rxType == PFT_Status) {
+        frameHandleStatus(channel);
+        *stashed = true;
+    } else if (channel->hasReadingId && channel->rxType == PFT_Response &&
+               channel->rxRequestId != channel->readingId) {
+        if (frameIsDropped(channel, channel->rxRequestId)) {
+            frameDrop(channel, firstFd);
+        } else {
+            frameStash(channel, firstFd);
+        }
+        *stashed = true;
+    } else {
+        *stashed = false;
+    }
+    return true;
+}
+
+/**
+ * Reads the next frame that isn't a status frame or a reply to some
+ * other request.
+ */
+static bool frameLoad(PipeChannel *channel) {
+    for (;;) {
+        bool skipped;
+        if (!frameLoadNext(channel, &skipped)) return false;
+        if (!skipped) return true;
+    }
+}
+
+/**
+ * Makes sure that a field of the given size can be read. Fields may
+ * continue in the next frame if the sender has flushed the stream.
+ */
+static bool frameNeed(PipeChannel *channel, size_t length) {
+    if (channel->rxPos == channel->rxLength && !frameLoad(channel)) {
+        pipeError();
+        return false;
+    }
+    
+    if (channel->rxLength - channel->rxPos < length) {
+        pipeError();
+        channel->failed = true;
+        channel->rxPos = channel->rxLength;
+        return false;
+    }
+    return true;
+}
+
+static int frameReadInt(PipeChannel *channel) {
+    if (!frameNeed(channel, 4)) return -1;
+    
+    int value = (int)getUInt32(&channel->rxData[channel->rxPos]);
+    channel->rxPos += 4;
+    return value;
+}
+
+/**
+ * Maps a string that was sent in a memfd. The memfd must be sealed, so
+ * the sender can't change it after it has been validated.
+ */
+static char *mapMemfd(int fd, size_t length) {
+    char *data = NULL;
+#ifdef HAVE_MEMFD
+    const int seals = F_SEAL_SHRINK | F_SEAL_WRITE;
+    struct stat st;
+    
+    if ((fcntl(fd, F_GET_SEALS) & seals) == seals &&
+        fstat(fd, &st) == 0 && (size_t)st.st_size == length+1) {
+        data = mmap(NULL, length+1, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                    fd, 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+        } else if (data[length] != '\0') {
+            munmap(data, length+1);
+            data = NULL;
+        }
+    }
+#endif
+    close(fd);
+    if (!data) pipeError();
+    return data;
+}
+
+/**
+ * Returns a pointer to the string data. The data is either in the frame
+ * buffer, which is valid until the next frame is read, or in a mapped
+ * memfd (then *mapped is set to true) which must be unmapped.
+ */
+static const char *frameReadData(PipeChannel *channel, size_t *length,
+                                 bool *mapped) {
+    *length = 0;
+    *mapped = false;
+    if (!frameNeed(channel, 4)) return NULL;
+    
+    size_t available = channel->rxLength - channel->rxPos - 4;
+    uint32_t datalen = getUInt32(&channel->rxData[channel->rxPos]);
+    if ((datalen & FIELD_IN_FD) && channel->rxFdCount > 0) {
+        channel->rxPos += 4;
+        
+        // Descriptors are read in the order they were sent
+        int fd = channel->rxFds[0];
+        memmove(&channel->rxFds[0], &channel->rxFds[1],
+                --channel->rxFdCount * sizeof(int));
+        
+        datalen &= ~FIELD_IN_FD;
+        const char *data = mapMemfd(fd, datalen);
+        if (data) {
+            *length = datalen;
+            *mapped = true;
+        }
+        return data;
+    }
+    
+    // The data must be followed by the null terminator, which callers
+    // rely on when the data is used as a string
+    if (datalen >= available ||
+        channel->rxData[channel->rxPos + 4 + datalen] != '\0') {
+        pipeError();
+        channel->rxPos = channel->rxLength;
+        return NULL;
+    }
+    
+    const char *data = &channel->rxData[channel->rxPos + 4];
+    channel->rxPos += 4 + datalen + 1;
+    *length = datalen;
+    return data;
+}
+
+/**
+ * Reads as much of the next frame as is available, without blocking.
+ * Returns PRS_Complete when a whole frame has been received, which can
+ * then be read with the pipe_read* functions. No data after the frame
+ * is read, so the file descriptor stays readable if there's more data.
+ * 
+ * The stdio buffer isn't used, so don't mix this with blocking reads.
+ * Streams that don't use the framed protocol are read in blocking mode.
+ */
+PipeReceiveStatus pipe_receive(FILE *in) {
+    PipeChannel *channel = findChannel(in);
+    if (!channel) {
+        return (pipe_atEnd(in) ? PRS_End : PRS_Complete);
+    }
+    
+    if (!channel->nonBlocking) {
+        // Sockets are read with MSG_DONTWAIT instead, since O_NONBLOCK
+        // would affect the output stream too.
+        if (!channel->isSocket) {
+            int fd = fileno(in);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+        channel->nonBlocking = true;
+    }
+    
+    for (;;) {
+        char *buffer;
+        size_t wanted;
+        if (!channel->partialHasHeader) {
+            buffer = channel->partialHeader;
+            wanted = FRAME_HEADER_SIZE;
+        } else {
+            buffer = channel->partialData;
+            wanted = channel->partialLength;
+        }
+        
+        if (channel->partialReceived < wanted) {
+            ssize_t count = channelRead(channel,
+                                        buffer + channel->partialReceived,
+                                        wanted - channel->partialReceived,
+                                        false);
+            if (count == 0) {
+                return PRS_End;
+            } else if (count < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return PRS_Incomplete;
+                }
+                pipeError();
+                return PRS_End;
+            }
+            channel->partialReceived += count;
+            continue;
+        }
+        
+        if (!channel->partialHasHeader) {
+            // Header is complete
+            uint32_t length;
+            if (!frameParseHeader(channel, channel->partialHeader, &length)) {
+                return PRS_End;
+            }
+            
+            char *data = realloc(channel->partialData, length ? length : 1);
+            if (!data) {
+                pipeError();
+                return PRS_End;
+            }
+            channel->partialData = data;
+            channel->partialLength = length;
+            channel->partialReceived = 0;
+            channel->partialHasHeader = true;
+        } else {
+            // Payload is complete. Swap buffers with the current frame.
+            frameRecordReceived(channel, channel->partialHeader,
+                                channel->partialData, channel->partialLength);
+            char *oldData = channel->rxData;
+            channel->rxData = channel->partialData;
+            channel->rxLength = channel->partialLength;
+            channel->rxPos = 0;
+            channel->rxLoaded = true;
+            
+            channel->partialData = oldData;
+            channel->partialLength = 0;
+            channel->partialReceived = 0;
+            channel->partialHasHeader = false;
+            return PRS_Complete;
+        }
+    }
+}
+
+/**
+ * Returns the features that can be used on a channel.
+ */
+static unsigned int localFeatures(const PipeChannel *channel) {
+    unsigned int features = PIPE_FEATURES;
+#ifdef HAVE_MEMFD
+    if (!channel->isSocket) features &= ~PF_FdPassing;
+#else
+    features &= ~PF_FdPassing;
+#endif
+    // Transcripts should contain all data
+    if (channel->recording) features &= ~PF_FdPassing;
+    return features;
+}
+
+/**
+ * Records all frames that are sent and received on a channel to a
+ * transcript file, which is appended to. This must be called before the
+ * HELLO frame is sent. Returns false if the file can't be opened.
+ */
+bool pipe_record(FILE *in, const char *filename) {
+    static uint32_t sessionCount = 0;
+    PipeChannel *channel = findChannel(in);
+    if (!channel) return false;
+    
+    // The transcript contains the signatures, so only the user may read it
+    int fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        fprintf(stderr, BINNAME ": failed to open IPC transcript %s: %s\n",
+                filename, strerror(errno));
+        return false;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0 &&
+        write(fd, RECORD_MAGIC, 8) != 8) {
+        close(fd);
+        return false;
+    }
+    
+    if (channel->recording) close(channel->recordFd);
+    channel->recording = true;
+    channel->recordFd = fd;
+    channel->recordSession = ((uint32_t)getpid() << 8) + sessionCount++;
+    return true;
+}
+
+/**
+ * Sends a HELLO frame with the protocol version and supported features.
+ */
+void pipe_sendHello(FILE *out) {
+    PipeChannel *channel = findChannel(out);
+    if (!channel) return;
+    
+    frameSend(channel);
+    channel->txType = PFT_Hello;
+    frameAddInt(channel, FRAMED_VERSION);
+    frameAddInt(channel, localFeatures(channel));
+    frameSend(channel);
+    fflush(out);
+}
+
+/**
+ * Reads a HELLO frame if the next frame is one. Returns false if the
+ * next frame is something else, or if the stream isn't framed.
+ */
+bool pipe_readHello(FILE *in) {
+    PipeChannel *channel = findChannel(in);
+    if (!channel) return false;
+    
+    if ((!channel->rxLoaded || channel->rxPos != 0) && !frameLoad(channel)) {
+        return false;
+    }
+    if (channel->rxType != PFT_Hello) return false;
+    
+    int version = frameReadInt(channel);
+    unsigned int features = (unsigned int)frameReadInt(channel);
+    channel->rxLoaded = false;
+    channel->rxPos = channel->rxLength;
+    
+    if (version != FRAMED_VERSION) {
+        fprintf(stderr, BINNAME ": unsupported IPC version %d\n", version);
+        return false;
+    }
+    
+    channel->features = features & localFeatures(channel);
+    return true;
+}
+
+/**
+ * Returns the features that both sides support.
+ */
+unsigned int pipe_getFeatures(FILE *file) {
+    PipeChannel *channel = findChannel(file);
+    return (channel ? channel->features : 0);
+}
+
+/**
+ * Sets the function that is called when a status frame is received.
+ */
+void pipe_setStatusFunction(FILE *in, PipeStatusFunction function,
+                            void *data) {
+    PipeChannel *channel = findChannel(in);
+    if (!channel) return;
+    channel->statusFunction = function;
+    channel->statusData = data;
 }
 
 /**
- * Waits in the event loop until there's data to read.
+ * Sends a status frame immediately, if the other side supports it. Any
+ * part of a reply that has been added already is sent first.
+ */
+void pipe_sendStatus(FILE *out, int status, int value) {
+    PipeChannel *channel = findChannel(out);
+    if (!channel || !(channel->features & PF_Status)) return;
+    
+    PipeFrameType txType = channel->txType;
+    frameSend(channel);
+    channel->txType = PFT_Status;
+    frameAddInt(channel, status);
+    frameAddInt(channel, value);
+    frameSend(channel);
+    channel->txType = txType;
+    fflush(out);
+}
+
+// Descriptor with events that are dispatched while waiting
+static int eventFd = -1;
+
+// Maximum number of main loop iterations per event
+#define MAX_EVENT_DISPATCH 8
+
+/**
+ * Sets a descriptor to watch while waiting for the other side. When it
+ * becomes readable, the pending sources in the default main context are
+ * dispatched. In the plugin this is the connection to the X server, so the
+ * browser can repaint and handle input while a command is running, but
+ * other sources (timers etc.) are not run unless there are X events.
+ */
+void pipe_setEventFd(int fd) {
+    eventFd = fd;
+}
+
+/**
+ * Dispatches pending events from the browser. Returns true if the reply to
+ * the given request has been read (and kept) meanwhile. Sets morePending
+ * if the limit was reached before all events were dispatched.
+ */
+static bool dispatchEvents(const PipeChannel *pipeChannel,
+                           uint32_t requestId, bool *morePending) {
+    for (int i = 0; i < MAX_EVENT_DISPATCH; i++) {
+        if (!g_main_context_iteration(NULL, FALSE)) {
+            *morePending = false;
+            return false;
+        }
+        if (pipeChannel && frameIsStashed(pipeChannel, requestId)) {
+            return true;
+        }
+    }
+    *morePending = true;
+    return false;
+}
+
+/**
+ * Waits until there's data to read.
  * 
  * Data may be buffered by stdio so only call this function
  * when you know that the other side will send data since
  * the last time this function was called.
  */
 void pipe_waitData(FILE *file) {
-    bool hasData = false;
-    GIOChannel *channel = g_io_channel_unix_new(fileno(file));
-    if (!channel) {
-        fprintf(stderr, BINNAME ": failed to create I/O channel\n");
-        return;
+    pipe_waitDataTimeout(file, 0);
+}
+
+/**
+ * Waits until the descriptor is readable, or a reply to the given request
+ * has been kept by some other call (if pipeChannel is non-NULL), or the
+ * given number of milliseconds have passed (if it's non-negative). Returns
+ * false on timeout or error.
+ * 
+ * Other calls can only run here if there are events on the descriptor set
+ * with pipe_setEventFd. Other browser sources are not serviced: the wait
+ * is bounded by the command timeout, and running arbitrary browser
+ * callbacks here could re-enter the plugin in any state.
+ */
+static bool waitReadableOrStashed(int fd, const PipeChannel *pipeChannel,
+                                  uint32_t requestId, gint64 timeout) {
+    gint64 deadline = (timeout >= 0 ?
+                       g_get_monotonic_time() + timeout*1000 : -1);
+    struct pollfd pfds[2] = {
+        { fd, POLLIN, 0 },
+        { eventFd, POLLIN, 0 },
+    };
+    nfds_t count = (eventFd != -1 ? 2 : 1);
+    bool morePending = false;
+    
+    for (;;) {
+        int pollTimeout = -1;
+        if (deadline >= 0) {
+            gint64 remaining = (deadline - g_get_monotonic_time() + 999)/1000;
+            if (remaining < 0) remaining = 0;
+            pollTimeout = (remaining < INT_MAX ? (int)remaining : INT_MAX);
+        }
+        // Events that were read from the connection but not dispatched
+        // don't make it readable, so continue with those right away
+        if (morePending) pollTimeout = 0;
+        
+        int ret = poll(pfds, count, pollTimeout);
+        if (ret == -1) {
+            if (errno == EINTR) continue;
+            pipeError();
+            return false;
+        }
+        
+        if (pfds[0].revents) return true;
+        if (count == 2 && (pfds[1].revents || morePending)) {
+            if (pfds[1].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                // Stop watching a broken connection
+                count = 1;
+            }
+            if (dispatchEvents(pipeChannel, requestId, &morePending)) {
+                return true;
+            }
+        }
+        if (deadline >= 0 && g_get_monotonic_time() >= deadline) {
+            return false;
+        }
     }
-    g_io_channel_set_encoding(channel, NULL, NULL);
-    g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
-                   stopWaiting, &hasData);
-    g_io_channel_unref(channel);
+}
+
+static bool waitReadable(int fd, gint64 timeout) {
+    return waitReadableOrStashed(fd, NULL, 0, timeout);
+}
+
+/**
+ * Like pipe_waitData, but gives up after the given number of seconds
+ * (unless it's zero). Returns false if there's no data.
+ */
+bool pipe_waitDataTimeout(FILE *file, int timeout) {
+    return waitReadable(fileno(file), (timeout > 0 ? timeout*1000 : -1));
+}
+
+/**
+ * Waits until the reply to the given request can be read, or until the
+ * given number of seconds have passed (unless it's zero). Returns false
+ * on timeout.
+ * 
+ * Other calls may run while browser events are dispatched, and may read replies
+ * to this request. Those are kept until they are read here, and replies
+ * to other requests that are received here are kept in the same way.
+ */
+bool pipe_waitReply(FILE *in, uint32_t requestId, int timeout) {
+    PipeChannel *channel = findChannel(in);
+    if (!channel) return pipe_waitDataTimeout(in, timeout);
     
-    while (!hasData) {
-        g_main_context_iteration(NULL, TRUE);
+    gint64 deadline = g_get_monotonic_time() + (gint64)timeout*1000000;
+    int fd = fileno(in);
+    for (;;) {
+        channel->hasReadingId = true;
+        channel->readingId = requestId;
+        if (frameIsStashed(channel, requestId)) return true;
+        
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 0) > 0) {
+            // Read the frame here, so it's possible to wait again if it
+            // belongs to some other request. At the end of the stream the
+            // caller will get an error when reading.
+            bool skipped;
+            if (!frameLoadNext(channel, &skipped) || !skipped) return true;
+            continue;
+        }
+        
+        gint64 remaining = -1;
+        if (timeout > 0) {
+            remaining = (deadline - g_get_monotonic_time()) / 1000;
+            if (remaining < 0) return false;
+        }
+        if (!waitReadableOrStashed(fd, channel, requestId, remaining)) {
+            return false;
+        }
     }
 }
 
+/**
+ * Receives the next request without waiting. Returns PRS_Incomplete if
+ * there's none, and also for streams that can't be read without blocking
+ * (i.e. that don't use the framed protocol).
+ */
+PipeReceiveStatus pipe_receiveNext(FILE *in) {
+    PipeChannel *channel = findChannel(in);
+    if (!channel || !channel->nonBlocking) return PRS_Incomplete;
+    return pipe_receive(in);
+}
+
+/**
+ * Returns the request id that replies are sent with (in the signer), or
+ * the id of the last request that was sent (in the plugin).
+ */
+uint32_t pipe_getRequestId(FILE *file) {
+    PipeChannel *channel = findChannel(file);
+    return (channel ? channel->requestId : 0);
+}
+
+/**
+ * Changes the request id that replies are sent with. Anything that has
+ * been added to the current reply is sent first.
+ */
+void pipe_setRequestId(FILE *out, uint32_t requestId) {
+    PipeChannel *channel = findChannel(out);
+    if (!channel) return;
+    frameSend(channel);
+    channel->requestId = requestId;
+}
+
+/**
+ * Skips any whitespace between commands and checks if the other side
+ * has closed the pipe.
+ */
+bool pipe_atEnd(FILE *in) {
+    PipeChannel *channel = findChannel(in);
+    if (channel) {
+        if (channel->rxLoaded && channel->rxPos < channel->rxLength) {
+            return false;
+        }
+        return !frameLoad(channel);
+    }
+    
+    return (fscanf(in, " ") == EOF || feof(in));
+}
+
 PipeCommand pipe_readCommand(FILE *in) {
+    PipeChannel *channel = findChannel(in);
+    if (channel) {
+        // Skip anything that's left of the previous request
+        if ((!channel->rxLoaded || channel->rxPos != 0) &&
+            !frameLoad(channel)) {
+            pipeError();
+            return -1;
+        }
+        if (channel->rxType != PFT_Request) {
+            pipeError();
+            return -1;
+        }
+        // The reply is sent with the id of the request
+        frameSend(channel);
+        channel->requestId = channel->rxRequestId;
+    }
+    
     return pipe_readInt(in);
 }
 
 void pipe_sendCommand(FILE *out, PipeCommand command) {
+    PipeChannel *channel = findChannel(out);
+    if (channel) {
+        frameSend(channel);
+        channel->txType = PFT_Request;
+        channel->requestId++;
+        frameAddInt(channel, command);
+        return;
+    }
+    
     fprintf(out, "%d;", command);
 }
 
 void pipe_finishCommand(FILE *out) {
-    fprintf(out, "\n");
+    PipeChannel *channel = findChannel(out);
+    if (channel) {
+        frameSend(channel);
+    } else {
+        fprintf(out, "\n");
+    }
+    fflush(out);
+}
+
+/**
+ * Asks the other side to abort the last command. With the framed protocol
+ * the cancel request has the same request id as the command.
+ */
+void pipe_sendCancel(FILE *out, uint32_t requestId) {
+    PipeChannel *channel = findChannel(out);
+    if (channel) {
+        frameSend(channel);
+        uint32_t current = channel->requestId;
+        channel->requestId = requestId;
+        channel->txType = PFT_Request;
+        frameAddInt(channel, PC_Cancel);
+        frameSend(channel);
+        channel->requestId = current;
+    } else {
+        fprintf(out, "%d;\n", PC_Cancel);
+    }
     fflush(out);
 }
 
+/**
+ * Gives up on the reply to the given request. Anything that has been kept
+ * for it is freed, and anything that arrives later is discarded. This is
+ * used when a request on a shared process times out, since the process
+ * can't be stopped.
+ */
+void pipe_dropReply(FILE *in, uint32_t requestId) {
+    PipeChannel *channel = findChannel(in);
+    if (!channel) return;
+    
+    PipeFrame **link = &channel->stash;
+    while (*link) {
+        PipeFrame *frame = *link;
+        if (frame->requestId == requestId) {
+            *link = frame->next;
+            free(frame->data);
+            closeFds(frame->fds, &frame->fdCount);
+            free(frame);
+        } else {
+            link = &frame->next;
+        }
+    }
+    
+    if (!frameIsDropped(channel, requestId)) {
+        channel->droppedIds[channel->droppedNext] = requestId;
+        channel->droppedNext = (channel->droppedNext+1) % FRAME_MAX_DROPPED;
+        if (channel->droppedCount < FRAME_MAX_DROPPED) channel->droppedCount++;
+    }
+}
+
+/**
+ * Returns true if the other side has closed the pipe, or if reading from
+ * or writing to it has failed. Framed channels don't use stdio, so this
+ * must be used instead of feof and ferror.
+ */
+bool pipe_hasError(FILE *file) {
+    PipeChannel *channel = findChannel(file);
+    if (channel) return channel->rxEnd || channel->failed;
+    return feof(file) || ferror(file);
+}
+
 void pipe_flush(FILE *out) {
+    PipeChannel *channel = findChannel(out);
+    if (channel) frameSend(channel);
     fflush(out);
 }
 
 void pipe_readData(FILE *in, char **data, int *length) {
+    PipeChannel *channel = findChannel(in);
+    if (channel) {
+        size_t datalen;
+        bool mapped;
+        const char *p = frameReadData(channel, &datalen, &mapped);
+        *data = NULL;
+        *length = 0;
+        if (p && datalen) {
+            *data = malloc(datalen);
+            if (*data) {
+                memcpy(*data, p, datalen);
+                *length = (int)datalen;
+            } else {
+                pipeError();
+            }
+        }
+        if (mapped) munmap((void *)p, datalen+1);
+        return;
+    }
+    
     *length = pipe_readInt(in);
     if (*length <= 0) {
         *length = 0;
@@ -110,6 +1584,24 @@ void pipe_readData(FILE *in, char **data, int *length) {
 }
 
 char *pipe_readString(FILE *in) {
+    PipeChannel *channel = findChannel(in);
+    if (channel) {
+        size_t datalen;
+        bool mapped;
+        const char *p = frameReadData(channel, &datalen, &mapped);
+        if (!p) return strdup("");
+        
+        char *str = malloc(datalen+1);
+        if (str) {
+            memcpy(str, p, datalen+1);
+        } else {
+            pipeError();
+            str = strdup("");
+        }
+        if (mapped) munmap((void *)p, datalen+1);
+        return str;
+    }
+    
     int length = pipe_readInt(in);
     if (length <= 0) return strdup("");
     
@@ -129,6 +1621,104 @@ char *pipe_readString(FILE *in) {
     }
 }
 
+/**
+ * Reads a string into a buffer supplied by the caller, such as a page of
+ * secure memory, without copying it to the heap. With the framed protocol
+ * the string is also wiped from the receive buffer.
+ * 
+ * Returns false if the string doesn't fit (it's skipped in that case) or
+ * on errors. The buffer contains an empty string then.
+ */
+bool pipe_readStringInto(FILE *in, char *buffer, size_t size) {
+    assert(buffer != NULL && size > 0);
+    buffer[0] = '\0';
+    
+    PipeChannel *channel = findChannel(in);
+    if (channel) {
+        size_t datalen;
+        bool mapped;
+        const char *p = frameReadData(channel, &datalen, &mapped);
+        if (!p) return false;
+        
+        bool fits = (datalen < size);
+        if (fits) memcpy(buffer, p, datalen+1);
+        if (mapped) {
+            munmap((void *)p, datalen+1);
+        } else {
+            memset((char *)p, 0, datalen);
+        }
+        return fits;
+    }
+    
+    int length = pipe_readInt(in);
+    if (length <= 0) return (length == 0);
+    
+    if ((size_t)length >= size) {
+        // Skip the string, a part at a time
+        while (length > 0) {
+            size_t chunk = ((size_t)length < size ? (size_t)length : size);
+            if (fread(buffer, chunk, 1, in) != 1) break;
+            length -= (int)chunk;
+        }
+        memset(buffer, 0, size);
+        return false;
+    }
+    
+    if (fread(buffer, length, 1, in) != 1) {
+        pipeError();
+        buffer[0] = '\0';
+        return false;
+    }
+    buffer[length] = '\0';
+    return true;
+}
+
+/**
+ * Reads a string that may be large. If it was sent in a memfd, then it's
+ * mapped read-only instead of being copied. The string must be freed
+ * with pipe_freeString and must not be modified.
+ */
+char *pipe_readLargeString(FILE *in) {
+    PipeChannel *channel = findChannel(in);
+    if (!channel || channel->rxPos + 4 > channel->rxLength ||
+        !(getUInt32(&channel->rxData[channel->rxPos]) & FIELD_IN_FD)) {
+        return pipe_readString(in);
+    }
+    
+    size_t datalen;
+    bool mapped;
+    const char *p = frameReadData(channel, &datalen, &mapped);
+    if (!p) return strdup("");
+    
+    PipeMapping *mapping = malloc(sizeof(PipeMapping));
+    if (!mapping) {
+        pipeError();
+        munmap((void *)p, datalen+1);
+        return strdup("");
+    }
+    mapping->data = (char *)p;
+    mapping->size = datalen+1;
+    mapping->next = mappings;
+    mappings = mapping;
+    return mapping->data;
+}
+
+/**
+ * Frees a string from pipe_readLargeString.
+ */
+void pipe_freeString(char *str) {
+    for (PipeMapping **link = &mappings; *link; link = &(*link)->next) {
+        PipeMapping *mapping = *link;
+        if (mapping->data == str) {
+            *link = mapping->next;
+            munmap(mapping->data, mapping->size);
+            free(mapping);
+            return;
+        }
+    }
+    free(str);
+}
+
 char *pipe_readOptionalString(FILE *in) {
     char *str = pipe_readString(in);
     if (str && str[0] == '\0') {
@@ -139,6 +1729,9 @@ char *pipe_readOptionalString(FILE *in) {
 }
 
 int pipe_readInt(FILE *in) {
+    PipeChannel *channel = findChannel(in);
+    if (channel) return frameReadInt(channel);
+    
     int value = -1;
     if (fscanf(in, " %d;", &value) != 1) {
         pipeError();
@@ -146,14 +1739,48 @@ int pipe_readInt(FILE *in) {
     return value;
 }
 
+/**
+ * Reads a 64-bit value, such as an X11 window id. It is sent as two
+ * 32-bit integers, with the most significant half first.
+ */
+uint64_t pipe_readInt64(FILE *in) {
+    PipeChannel *channel = findChannel(in);
+    if (channel) {
+        uint64_t high = (uint32_t)frameReadInt(channel);
+        return (high << 32) | (uint32_t)frameReadInt(channel);
+    }
+    
+    unsigned long long value = 0;
+    if (fscanf(in, " %llu;", &value) != 1) {
+        pipeError();
+    }
+    return value;
+}
+
 void pipe_sendData(FILE *out, const char *data, int length) {
     assert(data != NULL);
+    PipeChannel *channel = findChannel(out);
+    if (channel) {
+        frameAddData(channel, data, length, false);
+        return;
+    }
+    
     fprintf(out, "%d;", length);
     fwrite(data, length, 1, out);
 }
 
+/**
+ * Sends a string. With the framed protocol the string isn't copied,
+ * so it must not be freed until pipe_flush or pipe_finishCommand.
+ */
 void pipe_sendString(FILE *out, const char *str) {
     assert(str != NULL);
+    PipeChannel *channel = findChannel(out);
+    if (channel) {
+        frameAddData(channel, str, strlen(str), true);
+        return;
+    }
+    
     pipe_sendData(out, str, strlen(str));
 }
 
@@ -162,6 +1789,23 @@ void pipe_sendOptionalString(FILE *out, const char *str) {
 }
 
 void pipe_sendInt(FILE *out, int value) {
+    PipeChannel *channel = findChannel(out);
+    if (channel) {
+        frameAddInt(channel, value);
+        return;
+    }
+    
     fprintf(out, "%d;", value);
 }
 
+void pipe_sendInt64(FILE *out, uint64_t value) {
+    PipeChannel *channel = findChannel(out);
+    if (channel) {
+        frameAddInt(channel, (int)(uint32_t)(value >> 32));
+        frameAddInt(channel, (int)(uint32_t)value);
+        return;
+    }
+    
+    fprintf(out, "%llu;", (unsigned long long)value);
+}
+
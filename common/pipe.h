@@ -25,6 +25,8 @@
 #ifndef __PIPE_H__
 #define __PIPE_H__
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 // Commands to the main program
@@ -34,6 +36,9 @@ typedef enum {
     PC_Sign,
     PC_CreateRequest,
     PC_StoreCertificates,
+    PC_SignBatch,
+    PC_Cancel,
+    PC_Prefetch,
 } PipeCommand;
 
 typedef enum {
@@ -41,22 +46,75 @@ typedef enum {
     PLS_MoreData,
 } PipeListStatus;
 
+typedef enum {
+    PRS_Incomplete = 0,
+    PRS_Complete,
+    PRS_End,
+} PipeReceiveStatus;
+
+// Optional protocol features, advertised in the HELLO frame. Only the
+// features that both sides support may be used.
+typedef enum {
+    PF_FdPassing = 0x1, // large strings are sent in a memfd
+    PF_Status    = 0x2, // status frames are sent during commands
+    PF_Multiplex = 0x4, // quick commands may run during other commands
+    PF_TraceId   = 0x8, // commands have a trace correlation id
+} PipeFeature;
+
+#define PIPE_FEATURES (PF_FdPassing | PF_Status | PF_Multiplex | PF_TraceId)
+
+// Direction of a frame in a transcript (see pipe_record)
+typedef enum {
+    PRD_Sent = 0,
+    PRD_Received,
+} PipeRecordDirection;
+
+// Called when a status frame has been received (see SignerStatus)
+typedef void (*PipeStatusFunction)(uint32_t requestId, int status, int value,
+                                   void *data);
+
+void pipe_initFramed(FILE *in, FILE *out);
+void pipe_close(FILE *in, FILE *out);
+void pipe_sendHello(FILE *out);
+bool pipe_readHello(FILE *in);
+unsigned int pipe_getFeatures(FILE *file);
+void pipe_setStatusFunction(FILE *in, PipeStatusFunction function,
+                            void *data);
+void pipe_sendStatus(FILE *out, int status, int value);
+bool pipe_record(FILE *in, const char *filename);
+
 PipeCommand pipe_readCommand(FILE *in);
 void pipe_sendCommand(FILE *out, PipeCommand command);
 void pipe_finishCommand(FILE *out);
+void pipe_sendCancel(FILE *out, uint32_t requestId);
+void pipe_dropReply(FILE *in, uint32_t requestId);
+uint32_t pipe_getRequestId(FILE *file);
+void pipe_setRequestId(FILE *out, uint32_t requestId);
 void pipe_flush(FILE *out);
+bool pipe_hasError(FILE *file);
 
+void pipe_setEventFd(int fd);
 void pipe_waitData(FILE *file);
+bool pipe_waitDataTimeout(FILE *file, int timeout);
+bool pipe_waitReply(FILE *in, uint32_t requestId, int timeout);
+PipeReceiveStatus pipe_receiveNext(FILE *in);
+bool pipe_atEnd(FILE *in);
+PipeReceiveStatus pipe_receive(FILE *in);
 
 void pipe_readData(FILE *in, char **data, int *length);
 char *pipe_readString(FILE *in);
+bool pipe_readStringInto(FILE *in, char *buffer, size_t size);
 char *pipe_readOptionalString(FILE *in);
+char *pipe_readLargeString(FILE *in);
+void pipe_freeString(char *str);
 int pipe_readInt(FILE *in);
+uint64_t pipe_readInt64(FILE *in);
 
 void pipe_sendData(FILE *out, const char *data, int length);
 void pipe_sendString(FILE *out, const char *str);
 void pipe_sendOptionalString(FILE *out, const char *str);
 void pipe_sendInt(FILE *out, int value);
+void pipe_sendInt64(FILE *out, uint64_t value);
 
 #endif
 
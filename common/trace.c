@@ -0,0 +1,187 @@
+/*
+
+  Copyright (c) 2026 Samuel Lidén Borell <samuel@kodafritt.se>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+  
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+*/
+
+#define _BSD_SOURCE 1
+#define _POSIX_C_SOURCE 200112
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "../common/defines.h"
+#include "../common/trace.h"
+
+/*
+  Latency tracing
+  
+  If FRIBID_TRACE is set to a filename, then the plugin and the signer
+  append spans for the phases of each call to that file, in the Chrome
+  trace event format (which can be opened in chrome://tracing or
+  Perfetto). Both processes use the monotonic clock, so their spans line
+  up in the same timeline.
+  
+  The plugin assigns a correlation id to each method call, which is sent
+  to the signer with the request (see sendHeader in plugin/ipc.c). Spans
+  have it in args.id.
+  
+  Spans are timed like this:
+  
+      int64_t start = trace_begin();
+      ...
+      trace_end("name", start);
+  
+  When tracing is disabled, trace_begin returns 0 and trace_end returns
+  immediately, so the cost is a function call and a flag check.
+*/
+
+#if defined(FRIBID_CLIENT)
+#   define TRACE_PROCESS_NAME "signer"
+#elif defined(FRIBID_PLUGIN)
+#   define TRACE_PROCESS_NAME "plugin"
+#else
+#   define TRACE_PROCESS_NAME BINNAME
+#endif
+
+// Maximum length of a trace event
+#define TRACE_EVENT_SIZE 512
+#define TRACE_NAME_SIZE 64
+
+static enum { Trace_Unknown, Trace_Disabled, Trace_Enabled } state;
+static int traceFd = -1;
+static uint32_t currentId = 0;
+
+/**
+ * Writes an event to the trace file. Each event is written with a single
+ * write call, so several processes can append to the same file.
+ */
+static void writeEvent(const char *event, int length) {
+    if (length <= 0 || length >= TRACE_EVENT_SIZE) return;
+    if (write(traceFd, event, (size_t)length) != length) {
+        fprintf(stderr, BINNAME ": failed to write trace: %s\n",
+                strerror(errno));
+        close(traceFd);
+        state = Trace_Disabled;
+    }
+}
+
+/**
+ * Opens the trace file the first time it's called. Returns false if
+ * tracing is disabled.
+ */
+static bool traceEnabled() {
+    if (state != Trace_Unknown) return (state == Trace_Enabled);
+    
+    state = Trace_Disabled;
+    const char *filename = getenv("FRIBID_TRACE");
+    if (!filename || !*filename) return false;
+    
+    traceFd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                   0600);
+    if (traceFd == -1) {
+        fprintf(stderr, BINNAME ": failed to open trace file %s: %s\n",
+                filename, strerror(errno));
+        return false;
+    }
+    state = Trace_Enabled;
+    
+    // The closing bracket is optional in the trace event format, so the
+    // file is valid after each event
+    char event[TRACE_EVENT_SIZE];
+    struct stat st;
+    if (fstat(traceFd, &st) == 0 && st.st_size == 0) {
+        writeEvent("[\n", 2);
+    }
+    int length = snprintf(event, sizeof(event),
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+        "\"args\":{\"name\":\"" TRACE_PROCESS_NAME " %d\"}},\n",
+        (int)getpid(), (int)getpid());
+    writeEvent(event, length);
+    return (state == Trace_Enabled);
+}
+
+/**
+ * Returns a new correlation id, and makes it the current one. The ids are
+ * unique per process. The process id is mixed into them, so ids from
+ * different browser processes are unlikely to collide. (All bits of the
+ * process id are used, since it can be larger than 16 bits.)
+ */
+uint32_t trace_newId() {
+    static uint32_t counter = 0;
+    currentId = (uint32_t)getpid() * 2654435761u + ++counter;
+    return currentId;
+}
+
+/**
+ * Sets the correlation id of the following spans.
+ */
+void trace_setId(uint32_t id) {
+    currentId = id;
+}
+
+uint32_t trace_getId() {
+    return currentId;
+}
+
+/**
+ * Returns the start time of a span, or 0 if tracing is disabled.
+ */
+int64_t trace_begin() {
+    if (!traceEnabled()) return 0;
+    return g_get_monotonic_time();
+}
+
+/**
+ * Records a span that started at the given time (from trace_begin) and
+ * ends now. Characters that would need escaping in JSON are replaced in
+ * the name, since it may come from a web page.
+ */
+void trace_end(const char *name, int64_t start) {
+    if (!start || state != Trace_Enabled) return;
+    
+    int64_t now = g_get_monotonic_time();
+    char safeName[TRACE_NAME_SIZE];
+    size_t i;
+    for (i = 0; name[i] && i < sizeof(safeName)-1; i++) {
+        unsigned char c = (unsigned char)name[i];
+        safeName[i] = (c < 0x20 || c == '"' || c == '\\' ? '_' : (char)c);
+    }
+    safeName[i] = '\0';
+    
+    char event[TRACE_EVENT_SIZE];
+    int length = snprintf(event, sizeof(event),
+        "{\"name\":\"%s\",\"cat\":\"" BINNAME "\",\"ph\":\"X\","
+        "\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT ","
+        "\"pid\":%d,\"tid\":%d,\"args\":{\"id\":\"%08x\"}},\n",
+        safeName, (gint64)start, (gint64)(now - start),
+        (int)getpid(), (int)getpid(), (unsigned int)currentId);
+    writeEvent(event, length);
+}
+
@@ -0,0 +1,107 @@
+/*
+
+  Copyright (c) 2009-2011, 2026 Samuel Lidén Borell <samuel@kodafritt.se>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+  
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+*/
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "../common/validate.h"
+
+/*
+  Input validation
+  
+  These checks are done both in the plugin, so invalid requests can be
+  rejected without starting the signer, and in the signer, which doesn't
+  trust its input.
+*/
+
+/**
+ * Checks that a string is valid Base64 in canonical form, i.e. the same
+ * as base64_encode would produce. This is checked without decoding the
+ * data, since it may be large.
+ */
+bool is_canonical_base64(const char *encoded) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    
+    size_t length = strspn(encoded, alphabet);
+    size_t padding = strspn(&encoded[length], "=");
+    
+    if (encoded[length+padding] != '\0' || padding > 2 ||
+        (length + padding) % 4 != 0) {
+        return false;
+    }
+    if (padding == 0) return true;
+    
+    // The unused bits in the last character must be zero
+    int last = strchr(alphabet, encoded[length-1]) - alphabet;
+    return (last & (padding == 1 ? 0x3 : 0xF)) == 0;
+}
+
+bool is_valid_domain_name(const char *domain) {
+    static const char allowed[] = "abcdefghijklmnopqrstuvwxyz0123456789-.";
+    return (strspn(domain, allowed) == strlen(domain));
+}
+
+bool is_valid_ip_address(const char *ip) {
+    static const char allowed[] = "0123456789abcdef.[]:";
+    return (strspn(ip, allowed) == strlen(ip));
+}
+
+bool is_valid_hostname(const char *hostname) {
+    return is_valid_domain_name(hostname) || is_valid_ip_address(hostname);
+}
+
+bool is_https_url(const char *url) {
+    return !strncmp(url, "https://", 8);
+}
+
+/**
+ * Checks the page that a request comes from. Returns BIDERR_NotSSL if it
+ * wasn't loaded over HTTPS.
+ */
+BankIDError validate_origin(const char *url, const char *hostname,
+                            const char *ip) {
+    if (!is_https_url(url)) {
+        return BIDERR_NotSSL;
+    } else if (!is_valid_hostname(hostname) || !is_valid_ip_address(ip)) {
+        return BIDERR_InternalError;
+    }
+    return BIDERR_OK;
+}
+
+/**
+ * Checks that the challenge and texts of an authentication or signature
+ * are Base64 encoded. The message is not used for authentication.
+ */
+bool validate_signItem(const SignBatchItem *item, bool authentication) {
+    if (!item->challenge || !is_canonical_base64(item->challenge)) {
+        return false;
+    }
+    if (authentication) return true;
+    
+    return (item->message && is_canonical_base64(item->message) &&
+            (!item->invisibleMessage ||
+             is_canonical_base64(item->invisibleMessage)));
+}
+
@@ -0,0 +1,44 @@
+/*
+
+  Copyright (c) 2009-2011, 2026 Samuel Lidén Borell <samuel@kodafritt.se>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+  
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+*/
+
+#ifndef __VALIDATE_H__
+#define __VALIDATE_H__
+
+#include <stdbool.h>
+
+#include "biderror.h"
+#include "bidtypes.h"
+
+bool is_canonical_base64(const char *encoded);
+bool is_valid_domain_name(const char *domain);
+bool is_valid_ip_address(const char *ip);
+bool is_valid_hostname(const char *hostname);
+bool is_https_url(const char *url);
+
+BankIDError validate_origin(const char *url, const char *hostname,
+                            const char *ip);
+bool validate_signItem(const SignBatchItem *item, bool authentication);
+
+#endif
+
@@ -22,6 +22,7 @@
 
 */
 
+#define _GNU_SOURCE 1
 #define _BSD_SOURCE 1
 #define _POSIX_C_SOURCE 200112
 #include <stdbool.h>
@@ -29,109 +30,745 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 
+#include <glib.h>
+
 #include "../common/defines.h"
 #include "../common/pipe.h"
+#include "../common/trace.h"
 #include "plugin.h"
 
 static const char ipcOption[] = "--internal--ipc=" IPCVERSION;
-static const char windowIdOption[] = "--internal--window-id";
+static const char ipcTextOption[] = "--internal--ipc=" IPCVERSION_TEXT;
+static const char persistentOption[] = "--internal--persistent";
+
+extern char **environ;
 
 #define PIPE_READ_END  0
 #define PIPE_WRITE_END 1
 
-typedef struct {
+// Number of seconds an idle signer process is kept running for re-use
+#define IDLE_TIMEOUT 60
+// Number of seconds a pre-started signer process waits for its first command
+#define STANDBY_TIMEOUT 300
+// Maximum number of idle signer processes per browser
+#define MAX_IDLE_SIGNERS 2
+// Number of seconds the user has to complete a dialog
+#define COMMAND_TIMEOUT 600
+// Number of seconds for commands that don't show a dialog
+#define QUICK_COMMAND_TIMEOUT 30
+// Number of seconds the signer has to respond to a cancel request,
+// before it's killed
+#define CANCEL_GRACE_TIME 5
+// Maximum number of seconds the result of GetVersion is cached
+#define VERSION_CACHE_TIME 3600
+
+typedef struct PipeInfo {
     FILE *in;
     FILE *out;
 
     pid_t child;
+    bool helloPending;
+    int timeout;
+    
+    // Command in progress. Quick commands may share a signer process with
+    // a command that shows a dialog (if shared is set).
+    Plugin *plugin;
+    uint32_t requestId;
+    bool interactive;
+    bool shared;
+    bool killed;
+    struct PipeInfo *nextActive;
 } PipeInfo;
 
-static void openPipesWithArgs(PipeInfo *pipeinfo, const char *argv[]) {
-    int pipeIn[2];
-    int pipeOut[2];
+// Signer processes that are waiting for a command. These have either
+// completed a command already or have been started in advance.
+typedef struct {
+    PipeInfo pipes;
+    guint timer;
+} IdleSigner;
+
+static IdleSigner idleSigners[MAX_IDLE_SIGNERS];
+static int idleCount = 0;
+static bool standbyRequested = false;
+static KeyUsage standbyKeyUsage;
+
+// State of a file that the cached version string depends on
+typedef struct {
+    time_t mtime;
+    off_t size;
+} FileStamp;
+
+#define VERSION_STAMPS 3
+
+// Cached result of GetVersion
+static struct {
+    char *version;
+    time_t expiry;
+    FileStamp stamps[VERSION_STAMPS];
+} versionCache;
+
+static void clearVersionCache() {
+    free(versionCache.version);
+    versionCache.version = NULL;
+}
+
+// Commands in progress. Calls from other plugin objects may be made from
+// the main loop while waiting for a reply, so there can be several.
+static PipeInfo *activeCommands = NULL;
+
+static const char *getMainBinary() {
     const char *mainBinary = getenv("FRIBID_SIGN");
-    if (!mainBinary)
-	mainBinary = SIGNING_EXECUTABLE;
-	
+    return (mainBinary ? mainBinary : SIGNING_EXECUTABLE);
+}
+
+/**
+ * Returns the number of seconds to keep an idle signer process running.
+ * If this is zero then a new process is started for each call.
+ */
+static int getIdleTimeout() {
+    const char *value = getenv("FRIBID_IDLE_TIMEOUT");
+    return (value ? atoi(value) : IDLE_TIMEOUT);
+}
+
+/**
+ * Returns true if the old text protocol should be used, which can be
+ * selected with FRIBID_IPC=10.
+ */
+static bool useTextProtocol() {
+    const char *value = getenv("FRIBID_IPC");
+    return (value && !strcmp(value, IPCVERSION_TEXT));
+}
+
+/**
+ * Returns true if a socket should be used, so large strings can be sent
+ * in a memfd. This can be disabled with FRIBID_IPC_FDPASS=0.
+ */
+static bool useSocket() {
+    const char *value = getenv("FRIBID_IPC_FDPASS");
+    return (!useTextProtocol() && (!value || atoi(value) != 0));
+}
+
+/**
+ * Returns the file that the IPC frames should be recorded to, which can
+ * be set with FRIBID_IPC_RECORD. The file can be replayed with
+ * tools/ipc-replay.
+ */
+static const char *getRecordFilename() {
+    const char *filename = getenv("FRIBID_IPC_RECORD");
+    return (filename && *filename ? filename : NULL);
+}
+
+/**
+ * Returns the number of seconds before a command is cancelled. This can
+ * be overridden with FRIBID_TIMEOUT (0 means no timeout).
+ */
+static int getCommandTimeout(PipeCommand command) {
+    const char *value = getenv("FRIBID_TIMEOUT");
+    if (value) return atoi(value);
     
-    if (pipe(pipeIn) == -1 || pipe(pipeOut) == -1) {
+    switch (command) {
+        case PC_GetVersion:
+        case PC_StoreCertificates:
+            return QUICK_COMMAND_TIMEOUT;
+        default:
+            return COMMAND_TIMEOUT;
+    }
+}
+
+/**
+ * Returns true for commands that don't show a dialog.
+ */
+static bool isQuickCommand(PipeCommand command) {
+    return (command == PC_GetVersion || command == PC_StoreCertificates);
+}
+
+/**
+ * Returns true if the result of GetVersion may be cached. This can be
+ * disabled with FRIBID_VERSION_CACHE=0.
+ */
+static bool versionCacheEnabled() {
+    const char *value = getenv("FRIBID_VERSION_CACHE");
+    return (!value || atoi(value) != 0);
+}
+
+/**
+ * Returns true if signer processes should be started in advance.
+ */
+static bool standbyEnabled() {
+    const char *value = getenv("FRIBID_STANDBY");
+    return (!value || atoi(value) != 0);
+}
+
+/**
+ * Creates a socket pair, and returns it as the two pipes. The socket
+ * is used in both directions, but each end has two descriptors so it
+ * can be used by two FILE objects.
+ */
+static bool createSocket(int pipeIn[2], int pipeOut[2]) {
+    int sv[2];
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) return false;
+    
+    pipeIn[PIPE_READ_END] = sv[0];
+    pipeIn[PIPE_WRITE_END] = sv[1];
+    pipeOut[PIPE_READ_END] = fcntl(sv[1], F_DUPFD_CLOEXEC, 0);
+    pipeOut[PIPE_WRITE_END] = fcntl(sv[0], F_DUPFD_CLOEXEC, 0);
+    if (pipeOut[PIPE_READ_END] == -1 || pipeOut[PIPE_WRITE_END] == -1) {
+        for (int i = 0; i < 2; i++) {
+            close(pipeIn[i]);
+            if (pipeOut[i] != -1) close(pipeOut[i]);
+        }
+        return false;
+    }
+    return true;
+}
+
+static bool createPipes(int pipeIn[2], int pipeOut[2]) {
+    if (pipe2(pipeIn, O_CLOEXEC) == -1) {
         perror(BINNAME ": Failed to create pipe");
-        return;
+        return false;
+    }
+    if (pipe2(pipeOut, O_CLOEXEC) == -1) {
+        perror(BINNAME ": Failed to create pipe");
+        close(pipeIn[PIPE_READ_END]);
+        close(pipeIn[PIPE_WRITE_END]);
+        return false;
+    }
+    return true;
+}
+
+static bool openPipesWithArgs(PipeInfo *pipeinfo, const char *argv[],
+                              bool withSocket) {
+    int pipeIn[2];
+    int pipeOut[2];
+    
+    if (!(withSocket && createSocket(pipeIn, pipeOut)) &&
+        !createPipes(pipeIn, pipeOut)) {
+        return false;
+    }
+    
+    // The browser process can be very large, so fork() is avoided here
+    // since it has to copy the page tables. posix_spawn can use vfork or
+    // similar, where the child shares memory with the parent until exec.
+    // The pipe ends are created close-on-exec, so they can't leak into
+    // processes spawned by other threads. dup2 clears the flag on the
+    // descriptors given to the signer.
+    posix_spawn_file_actions_t actions;
+    bool ok = false;
+    
+    if (posix_spawn_file_actions_init(&actions) == 0) {
+        int error = 0;
+        if (posix_spawn_file_actions_adddup2(&actions, pipeIn[PIPE_WRITE_END],
+                                             STDOUT_FILENO) != 0 ||
+            posix_spawn_file_actions_adddup2(&actions, pipeOut[PIPE_READ_END],
+                                             STDIN_FILENO) != 0) {
+            fprintf(stderr, BINNAME ": Failed to set up pipes\n");
+        } else if ((error = posix_spawnp(&pipeinfo->child, argv[0], &actions,
+                                         NULL, (char *const *)argv,
+                                         environ)) != 0) {
+            fprintf(stderr, BINNAME ": Failed to start main binary: %s\n",
+                    strerror(error));
+        } else {
+            ok = true;
+        }
+        posix_spawn_file_actions_destroy(&actions);
     }
     
-    pipeinfo->child = fork();
-    if (pipeinfo->child == 0) {
-        // Child process
-        close(STDOUT_FILENO);
-        close(STDIN_FILENO);
+    close(pipeOut[PIPE_READ_END]);
+    close(pipeIn[PIPE_WRITE_END]);
+    
+    if (!ok) {
         close(pipeIn[PIPE_READ_END]);
         close(pipeOut[PIPE_WRITE_END]);
-        dup2(pipeIn[PIPE_WRITE_END], STDOUT_FILENO);
-        dup2(pipeOut[PIPE_READ_END], STDIN_FILENO);
-        
-        // These have been copied now
-        //close(pipeIn[PIPE_WRITE_END]);
-        //close(pipeOut[PIPE_READ_END]);
+        return false;
+    }
+    
+    pipeinfo->in = fdopen(pipeIn[PIPE_READ_END], "r");
+    pipeinfo->out = fdopen(pipeOut[PIPE_WRITE_END], "w");
+    return true;
+}
+
+static void closePipes(PipeInfo *pipeinfo) {
+    pipe_close(pipeinfo->in, pipeinfo->out);
+    waitpid(pipeinfo->child, NULL, 0);
+}
+
+static void removeIdleSigner(int index) {
+    if (idleSigners[index].timer) {
+        g_source_remove(idleSigners[index].timer);
+    }
+    idleSigners[index] = idleSigners[--idleCount];
+}
+
+static gboolean idleTimeout(gpointer data) {
+    pid_t child = (pid_t)GPOINTER_TO_INT(data);
+    
+    for (int i = 0; i < idleCount; i++) {
+        if (idleSigners[i].pipes.child == child) {
+            PipeInfo pipes = idleSigners[i].pipes;
+            idleSigners[i].timer = 0; // removed when we return FALSE
+            removeIdleSigner(i);
+            closePipes(&pipes);
+            break;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * Adds a signer process to the list of idle processes. The process is
+ * stopped if it isn't used within the given number of seconds, or
+ * immediately if there are too many idle processes already.
+ */
+static void addIdleSigner(PipeInfo *pipeinfo, int timeout) {
+    if (timeout <= 0 || idleCount == MAX_IDLE_SIGNERS) {
+        closePipes(pipeinfo);
+        return;
+    }
+    
+    IdleSigner *idle = &idleSigners[idleCount++];
+    idle->pipes = *pipeinfo;
+    idle->timer = g_timeout_add_seconds(timeout, idleTimeout,
+                                        GINT_TO_POINTER(pipeinfo->child));
+}
+
+/**
+ * Takes an idle signer process, if there is one that's still running.
+ */
+static bool takeIdleSigner(PipeInfo *pipeinfo) {
+    while (idleCount > 0) {
+        PipeInfo pipes = idleSigners[idleCount-1].pipes;
+        removeIdleSigner(idleCount-1);
         
-        execvp(mainBinary, (char *const *)argv);
-        perror(BINNAME ": Failed to execute main binary");
-        exit(1);
-    } else {
-        // Parent process
-        close(pipeOut[PIPE_READ_END]);
-        close(pipeIn[PIPE_WRITE_END]);
+        if (waitpid(pipes.child, NULL, WNOHANG) == 0) {
+            pipeinfo->in = pipes.in;
+            pipeinfo->out = pipes.out;
+            pipeinfo->child = pipes.child;
+            pipeinfo->helloPending = pipes.helloPending;
+            pipeinfo->timeout = pipes.timeout;
+            return true;
+        }
         
-        pipeinfo->in = fdopen(pipeIn[PIPE_READ_END], "r");
-        pipeinfo->out = fdopen(pipeOut[PIPE_WRITE_END], "w");
+        // The process has exited
+        pipe_close(pipes.in, pipes.out);
     }
+    return false;
 }
 
-static void openPipes(PipeInfo *pipeinfo, const Plugin *plugin) {
-    char windowId[21]; // This holds a native window id (such as an XID)
+/**
+ * Records the progress of a command, for GetParam("Status") and
+ * GetParam("StatusLog").
+ */
+static void setStatus(Plugin *plugin, SignerStatus status, int value) {
+    if (status == SignerStatus_Started) {
+        plugin->statusStart = g_get_monotonic_time();
+        free(plugin->statusLog);
+        plugin->statusLog = NULL;
+    }
+    plugin->status = status;
+    plugin->statusValue = value;
+    
+    // Append "Status:value@milliseconds" to the log
+    char *entry = plugin_getStatusParam(plugin, "Status");
+    GString *log = g_string_new(plugin->statusLog);
+    if (plugin->statusLog) g_string_append_c(log, ',');
+    g_string_append_printf(log, "%s@%" G_GINT64_FORMAT, (entry ? entry : ""),
+                           (g_get_monotonic_time() - plugin->statusStart) / 1000);
+    free(entry);
+    
+    free(plugin->statusLog);
+    plugin->statusLog = strdup(log->str);
+    g_string_free(log, TRUE);
+}
+
+/**
+ * Called when a signer sends a status frame. The data is the input stream
+ * of the signer.
+ */
+static void statusReceived(uint32_t requestId, int status, int value,
+                           void *data) {
+    if (status <= SignerStatus_Started || status >= SignerStatus_Done) return;
+    
+    for (PipeInfo *active = activeCommands; active;
+         active = active->nextActive) {
+        if (active->in == (FILE*)data && active->requestId == requestId) {
+            setStatus(active->plugin, (SignerStatus)status, value);
+            break;
+        }
+    }
+}
+
+/**
+ * Starts a new signer process. With the framed protocol, the HELLO frame
+ * is sent immediately, and the reply is read before the first command.
+ */
+static bool startSigner(PipeInfo *pipeinfo) {
+    bool framed = !useTextProtocol();
     const char *argv[] = {
-        mainBinary, ipcOption, windowIdOption, windowId, (char *)NULL,
+        getMainBinary(), (framed ? ipcOption : ipcTextOption),
+        persistentOption, (char *)NULL,
     };
     
-    snprintf(windowId, 21, "%ld", plugin->windowId);
-    openPipesWithArgs(pipeinfo, argv);
+    int64_t traceStart = trace_begin();
+    if (!openPipesWithArgs(pipeinfo, argv, framed && useSocket())) {
+        return false;
+    }
+    trace_end("spawn signer", traceStart);
+    
+    pipeinfo->helloPending = framed;
+    pipeinfo->timeout = 0;
+    if (framed) {
+        pipe_initFramed(pipeinfo->in, pipeinfo->out);
+        pipe_setStatusFunction(pipeinfo->in, statusReceived, pipeinfo->in);
+        
+        const char *recordFilename = getRecordFilename();
+        if (recordFilename) pipe_record(pipeinfo->in, recordFilename);
+        pipe_sendHello(pipeinfo->out);
+    }
+    return true;
+}
+
+/**
+ * Finds a signer process that is showing a dialog, and that can run quick
+ * commands at the same time.
+ */
+static bool shareActiveSigner(PipeInfo *pipeinfo) {
+    for (PipeInfo *active = activeCommands; active;
+         active = active->nextActive) {
+        if (active->interactive && !active->shared &&
+            (pipe_getFeatures(active->in) & PF_Multiplex)) {
+            pipeinfo->in = active->in;
+            pipeinfo->out = active->out;
+            pipeinfo->child = active->child;
+            pipeinfo->helloPending = false;
+            pipeinfo->timeout = 0;
+            pipeinfo->shared = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Connects to a signer process. A running process is re-used if there is
+ * one, otherwise a new one is started. The window id is sent with each
+ * command (see sendHeader) since the process may outlive the plugin object.
+ * 
+ * Quick commands are sent to a process that is showing a dialog if there
+ * is no idle one, so another process doesn't have to be started.
+ */
+static bool openPipes(PipeInfo *pipeinfo, PipeCommand command) {
+    pipeinfo->plugin = NULL;
+    pipeinfo->requestId = 0;
+    pipeinfo->interactive = !isQuickCommand(command);
+    pipeinfo->shared = false;
+    pipeinfo->killed = false;
+    pipeinfo->nextActive = NULL;
+    
+    if (!takeIdleSigner(pipeinfo) &&
+        !(!pipeinfo->interactive && shareActiveSigner(pipeinfo)) &&
+        !startSigner(pipeinfo)) {
+        return false;
+    }
+    
+    // The standby signer was requested for the dialog that starts now
+    if (pipeinfo->interactive) standbyRequested = false;
+    
+    if (pipeinfo->helloPending) {
+        int64_t traceStart = trace_begin();
+        if (!pipe_waitDataTimeout(pipeinfo->in, QUICK_COMMAND_TIMEOUT)) {
+            kill(pipeinfo->child, SIGKILL);
+        }
+        if (!pipe_readHello(pipeinfo->in)) {
+            fprintf(stderr, BINNAME ": no HELLO from the signer\n");
+            closePipes(pipeinfo);
+            return false;
+        }
+        pipeinfo->helloPending = false;
+        trace_end("wait for HELLO", traceStart);
+    }
+    return true;
+}
+
+/**
+ * Sets the connection to the X server, which is watched while waiting for
+ * the signer so the browser can repaint. All instances in a process use
+ * the same connection, so only the first one is used.
+ */
+void ipc_setDisplayFd(int fd) {
+    static bool displaySet = false;
+    if (displaySet || fd == -1) return;
+    displaySet = true;
+    pipe_setEventFd(fd);
+}
+
+/**
+ * Starts a signer process in advance, so it has done all initialization
+ * when the first command is sent to it. This is done when a plugin object
+ * that will probably show a dialog is created.
+ * 
+ * The signer that will be used next also reads the key files with the
+ * given usage meanwhile, so the dialog can show them immediately. This
+ * request has no reply. If the standby signer is used up by other commands
+ * before the dialog is shown, then releasePipes starts a new one.
+ */
+void ipc_prestartSigner(KeyUsage keyUsage) {
+    PipeInfo pipeinfo;
+    
+    if (!standbyEnabled()) return;
+    standbyRequested = true;
+    standbyKeyUsage = keyUsage;
+    
+    if (idleCount < MAX_IDLE_SIGNERS && startSigner(&pipeinfo)) {
+        addIdleSigner(&pipeinfo, STANDBY_TIMEOUT);
+    }
+    
+    if (idleCount > 0) {
+        FILE *out = idleSigners[idleCount-1].pipes.out;
+        pipe_sendCommand(out, PC_Prefetch);
+        pipe_sendInt(out, keyUsage);
+        pipe_finishCommand(out);
+    }
 }
 
-static void sendHeader(PipeInfo *pipeinfo, const Plugin *plugin,
+/**
+ * Called when a command has completed. The signer process is kept running
+ * for a while, so the next call doesn't have to start a new process. If
+ * processes aren't re-used, and a dialog is still expected, then a new one
+ * is started in advance instead.
+ */
+static void releasePipes(PipeInfo *pipeinfo) {
+    if (pipeinfo->plugin) {
+        setStatus(pipeinfo->plugin, SignerStatus_Done, 0);
+        pipeinfo->plugin = NULL;
+        
+        for (PipeInfo **link = &activeCommands; *link;
+             link = &(*link)->nextActive) {
+            if (*link == pipeinfo) {
+                *link = pipeinfo->nextActive;
+                break;
+            }
+        }
+    }
+    
+    if (pipeinfo->shared) {
+        // The process is released by the command that uses it for a dialog
+        return;
+    }
+    
+    if (pipeinfo->killed || pipe_hasError(pipeinfo->in) ||
+        pipe_hasError(pipeinfo->out)) {
+        closePipes(pipeinfo);
+    } else {
+        addIdleSigner(pipeinfo, getIdleTimeout());
+    }
+    
+    if (standbyRequested && idleCount == 0) {
+        ipc_prestartSigner(standbyKeyUsage);
+    }
+}
+
+/**
+ * Stops all idle signer processes. Called when the plugin is unloaded.
+ */
+void ipc_shutdown() {
+    while (idleCount > 0) {
+        PipeInfo pipes = idleSigners[idleCount-1].pipes;
+        removeIdleSigner(idleCount-1);
+        closePipes(&pipes);
+    }
+    clearVersionCache();
+}
+
+static void sendHeader(PipeInfo *pipeinfo, Plugin *plugin,
                        PipeCommand command) {
     pipe_sendCommand(pipeinfo->out, command);
+    
+    // The signer reports its progress until releasePipes is called
+    pipeinfo->plugin = plugin;
+    pipeinfo->requestId = pipe_getRequestId(pipeinfo->out);
+    pipeinfo->nextActive = activeCommands;
+    activeCommands = pipeinfo;
+    setStatus(plugin, SignerStatus_Started, 0);
+    
     pipe_sendString(pipeinfo->out, plugin->url);
     pipe_sendString(pipeinfo->out, plugin->hostname);
     pipe_sendString(pipeinfo->out, plugin->ip);
+    pipe_sendInt64(pipeinfo->out, plugin->windowId);
+    
+    // The signer cancels the command by itself after this many seconds
+    pipeinfo->timeout = getCommandTimeout(command);
+    pipe_sendInt(pipeinfo->out, pipeinfo->timeout);
+    
+    // Correlation id of the spans in the trace file (see common/trace.c)
+    if (pipe_getFeatures(pipeinfo->out) & PF_TraceId) {
+        pipe_sendInt(pipeinfo->out, (int)trace_getId());
+    }
 }
 
-static BankIDError waitReply(PipeInfo *pipeinfo) {
+/**
+ * Sends the command and waits for the reply. If the signer doesn't reply
+ * in time, then the command is cancelled, and if the signer doesn't
+ * respond to that either then it's killed. A shared signer is never
+ * killed, since it's showing a dialog for another command. Only the reply
+ * to this request is given up then. Returns false in both cases.
+ */
+static bool waitForSigner(PipeInfo *pipeinfo) {
     pipe_finishCommand(pipeinfo->out);
     
-    pipe_waitData(pipeinfo->in);
+    uint32_t requestId = pipeinfo->requestId;
+    int64_t traceStart = trace_begin();
+    bool replied = pipe_waitReply(pipeinfo->in, requestId, pipeinfo->timeout);
+    trace_end("wait for reply", traceStart);
+    if (replied) return true;
+    
+    fprintf(stderr, BINNAME ": signer timed out, cancelling\n");
+    pipe_sendCancel(pipeinfo->out, requestId);
+    if (pipe_waitReply(pipeinfo->in, requestId, CANCEL_GRACE_TIME)) {
+        return true;
+    }
+    
+    if (pipeinfo->shared) {
+        // The process is still showing a dialog for another command, so
+        // only this request is given up
+        fprintf(stderr, BINNAME ": signer is not responding to a "
+                "shared request, giving up\n");
+        pipe_dropReply(pipeinfo->in, requestId);
+        return false;
+    }
+    
+    // The signer is probably stuck in a PKCS#11 module or similar.
+    // It's closed by releasePipes instead of being re-used.
+    fprintf(stderr, BINNAME ": signer is not responding, killing it\n");
+    kill(pipeinfo->child, SIGKILL);
+    pipeinfo->killed = true;
+    return false;
+}
+
+static BankIDError waitReply(PipeInfo *pipeinfo) {
+    if (!waitForSigner(pipeinfo)) return BIDERR_Timeout;
     
     // Return error code
     return pipe_readInt(pipeinfo->in);
 }
 
-static void closePipes(PipeInfo *pipeinfo) {
-    fclose(pipeinfo->out);
-    fclose(pipeinfo->in);
-    waitpid(pipeinfo->child, NULL, 0);
+
+/**
+ * Returns the number of seconds until the version string expires, based
+ * on its best_before value. Returns 0 if it can't be cached.
+ */
+static time_t getVersionLifetime(const char *version, time_t now) {
+    const char *bestBefore = strstr(version, "best_before=");
+    if (!bestBefore) return 0;
+    
+    long long expiry = atoll(bestBefore + 12);
+    if (expiry <= now) return 0;
+    return (expiry - now < VERSION_CACHE_TIME ?
+            (time_t)(expiry - now) : VERSION_CACHE_TIME);
+}
+
+/**
+ * Returns the name of the file in the configuration directory of the
+ * signer (see platform_openConfig in the signer).
+ */
+static char *getConfigFilename(const char *configname) {
+    return g_build_filename(g_get_user_config_dir(), BINNAME, configname,
+                            NULL);
+}
+
+/**
+ * Gets the modification time and size of a file, or zeroes if it doesn't
+ * exist.
+ */
+static void getFileStamp(const char *filename, FileStamp *stamp) {
+    struct stat st;
+    if (filename && stat(filename, &st) == 0) {
+        stamp->mtime = st.st_mtime;
+        stamp->size = st.st_size;
+    } else {
+        stamp->mtime = 0;
+        stamp->size = 0;
+    }
+}
+
+/**
+ * Gets the state of the files that the version string depends on: the
+ * preferences, the expiry information, and the signer itself.
+ */
+static void getVersionStamps(FileStamp stamps[VERSION_STAMPS]) {
+    char *config = getConfigFilename("config");
+    char *expiry = getConfigFilename("expiry");
+    
+    getFileStamp(config, &stamps[0]);
+    getFileStamp(expiry, &stamps[1]);
+    getFileStamp(getMainBinary(), &stamps[2]);
+    
+    g_free(expiry);
+    g_free(config);
+}
+
+/**
+ * Returns the cached version string if it's still valid.
+ */
+static char *getCachedVersion() {
+    if (!versionCache.version) return NULL;
+    
+    FileStamp stamps[VERSION_STAMPS];
+    getVersionStamps(stamps);
+    if (time(NULL) >= versionCache.expiry ||
+        memcmp(stamps, versionCache.stamps, sizeof(stamps)) != 0) {
+        clearVersionCache();
+        return NULL;
+    }
+    return strdup(versionCache.version);
 }
 
+static void cacheVersion(const char *version, const FileStamp *stamps) {
+    time_t now = time(NULL);
+    time_t lifetime = getVersionLifetime(version, now);
+    if (lifetime <= 0) return;
+    
+    clearVersionCache();
+    versionCache.version = strdup(version);
+    versionCache.expiry = now + lifetime;
+    memcpy(versionCache.stamps, stamps, sizeof(versionCache.stamps));
+}
 
+/**
+ * Returns the version string. Web sites check this on every page load,
+ * so it's cached until it expires or the configuration changes.
+ */
 char *version_getVersion(Plugin *plugin) {
     PipeInfo pipeinfo;
     
-    openPipes(&pipeinfo, plugin);
+    bool useCache = versionCacheEnabled();
+    if (useCache) {
+        char *version = getCachedVersion();
+        if (version) return version;
+    }
+    
+    // Check the files before starting, so changes made meanwhile are
+    // detected the next time
+    FileStamp stamps[VERSION_STAMPS];
+    if (useCache) getVersionStamps(stamps);
+    
+    if (!openPipes(&pipeinfo, PC_GetVersion)) return NULL;
     sendHeader(&pipeinfo, plugin, PC_GetVersion);
-    pipe_finishCommand(pipeinfo.out);
     
-    char *version = pipe_readString(pipeinfo.in);
-    closePipes(&pipeinfo);
+    char *version = (waitForSigner(&pipeinfo) ?
+                     pipe_readString(pipeinfo.in) : NULL);
+    releasePipes(&pipeinfo);
+    
+    if (useCache && version) cacheVersion(version, stamps);
     return version;
 }
 
@@ -146,20 +783,26 @@ static void sendSignCommon(PipeInfo *pipeinfo, const Plugin *plugin) {
 int sign_performAction_Authenticate(Plugin *plugin) {
     PipeInfo pipeinfo;
     
-    openPipes(&pipeinfo, plugin);
+    if (!openPipes(&pipeinfo, PC_Authenticate)) {
+        plugin->lastError = BIDERR_InternalError;
+        return plugin->lastError;
+    }
     sendHeader(&pipeinfo, plugin, PC_Authenticate);
     sendSignCommon(&pipeinfo, plugin);
     
     plugin->lastError = waitReply(&pipeinfo);
     plugin->info.auth.signature = pipe_readString(pipeinfo.in);
-    closePipes(&pipeinfo);
+    releasePipes(&pipeinfo);
     return plugin->lastError;
 }
 
 int sign_performAction_Sign(Plugin *plugin) {
     PipeInfo pipeinfo;
     
-    openPipes(&pipeinfo, plugin);
+    if (!openPipes(&pipeinfo, PC_Sign)) {
+        plugin->lastError = BIDERR_InternalError;
+        return plugin->lastError;
+    }
     sendHeader(&pipeinfo, plugin, PC_Sign);
     sendSignCommon(&pipeinfo, plugin);
     
@@ -169,14 +812,62 @@ int sign_performAction_Sign(Plugin *plugin) {
     
     plugin->lastError = waitReply(&pipeinfo);
     plugin->info.auth.signature = pipe_readString(pipeinfo.in);
-    closePipes(&pipeinfo);
+    releasePipes(&pipeinfo);
+    return plugin->lastError;
+}
+
+int sign_performAction_SignBatch(Plugin *plugin) {
+    PipeInfo pipeinfo;
+    
+    if (!openPipes(&pipeinfo, PC_SignBatch)) {
+        plugin->lastError = BIDERR_InternalError;
+        return plugin->lastError;
+    }
+    sendHeader(&pipeinfo, plugin, PC_SignBatch);
+    
+    pipe_sendInt(pipeinfo.out, plugin->info.sign.serverTime);
+    pipe_sendOptionalString(pipeinfo.out, plugin->info.sign.policys);
+    pipe_sendOptionalString(pipeinfo.out, plugin->info.sign.subjectFilter);
+    pipe_sendString(pipeinfo.out, plugin->info.sign.messageEncoding);
+    
+    // Send the items
+    SignBatchItem *item;
+    for (item = plugin->info.sign.batch; item; item = item->next) {
+        pipe_sendInt(pipeinfo.out, PLS_MoreData);
+        
+        pipe_sendString(pipeinfo.out, item->challenge);
+        pipe_sendString(pipeinfo.out, item->message);
+        pipe_sendOptionalString(pipeinfo.out, item->invisibleMessage);
+    }
+    pipe_sendInt(pipeinfo.out, PLS_End);
+    
+    plugin->lastError = waitReply(&pipeinfo);
+    
+    // One signature is returned for each item
+    GString *signatures = g_string_new(NULL);
+    for (item = plugin->info.sign.batch; item; item = item->next) {
+        char *signature = pipe_readString(pipeinfo.in);
+        if (item != plugin->info.sign.batch) {
+            g_string_append_c(signatures, ',');
+        }
+        if (signature) g_string_append(signatures, signature);
+        free(signature);
+    }
+    releasePipes(&pipeinfo);
+    
+    free(plugin->info.sign.signature);
+    plugin->info.sign.signature = strdup(signatures->str);
+    g_string_free(signatures, TRUE);
     return plugin->lastError;
 }
 
 char *regutil_createRequest(Plugin *plugin) {
     PipeInfo pipeinfo;
     
-    openPipes(&pipeinfo, plugin);
+    if (!openPipes(&pipeinfo, PC_CreateRequest)) {
+        plugin->lastError = BIDERR_InternalError;
+        return NULL;
+    }
     sendHeader(&pipeinfo, plugin, PC_CreateRequest);
     
     // Send password policy
@@ -210,20 +901,23 @@ char *regutil_createRequest(Plugin *plugin) {
         request = NULL;
     }
     
-    closePipes(&pipeinfo);
+    releasePipes(&pipeinfo);
     return request;
 }
 
 void regutil_storeCertificates(Plugin *plugin, const char *certs) {
     PipeInfo pipeinfo;
     
-    openPipes(&pipeinfo, plugin);
+    if (!openPipes(&pipeinfo, PC_StoreCertificates)) {
+        plugin->lastError = BIDERR_InternalError;
+        return;
+    }
     sendHeader(&pipeinfo, plugin, PC_StoreCertificates);
     
     pipe_sendOptionalString(pipeinfo.out, certs);
     
     plugin->lastError = waitReply(&pipeinfo);
-    closePipes(&pipeinfo);    
+    releasePipes(&pipeinfo);
 }
 
 
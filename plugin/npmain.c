@@ -32,6 +32,7 @@
 #include "../common/defines.h"
 #include "plugin.h"
 #include "npobject.h"
+#include "pluginutil.h"
 
 // Change to "/" to make this plugin work with Opera
 #define NO_FILE_EXTENSIONS ""
@@ -41,6 +42,16 @@ NPError NPP_New(NPMIMEType pluginType, NPP instance, uint16 mode,
     instance->pdata = npobject_fromMIME(instance, pluginType);
     
     if (instance->pdata) {
+        ipc_setDisplayFd(getDisplayFd(instance));
+        
+        // These objects will show a dialog, so start a signer process
+        // and find the tokens in advance to reduce the delay when the
+        // dialog is opened
+        if (!strcmp(pluginType, MIME_AUTHENTICATION)) {
+            ipc_prestartSigner(KeyUsage_Authentication);
+        } else if (!strcmp(pluginType, MIME_SIGNER)) {
+            ipc_prestartSigner(KeyUsage_Signing);
+        }
         return NPERR_NO_ERROR;
     } else {
         return NPERR_INVALID_PARAM;
@@ -95,6 +106,7 @@ NPError NPP_Initialize() {
 }
 
 void NPP_Shutdown() {
+    ipc_shutdown();
 }
 
 
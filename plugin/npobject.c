@@ -32,12 +32,10 @@
 #include <npapi.h>
 #include <npruntime.h>
 
+#include "../common/trace.h"
 #include "pluginutil.h"
 #include "npobject.h"
 
-// Prevent concurrent/recursive calls (and multiple windows appearing)
-static bool pluginActive = false;
-
 /* Object methods */
 static NPObject *objAllocate(NPP npp, NPClass *aClass) {
     return malloc(sizeof(PluginObject));
@@ -138,7 +136,18 @@ static bool objInvokeSafe(PluginObject *this, const char *name,
             return false;
         case PT_Regutil:
             if (IS_CALL_1("GetParam", STRING)) {
-                // Get parameter. Seems to always return null
+                // Get parameter. Seems to always return null, except for
+                // the progress of the last call (a FriBID extension)
+                char *param = variantToStringZ(&args[0]);
+                if (!param) return false;
+                
+                char *value = plugin_getStatusParam(this->plugin, param);
+                free(param);
+                if (value) {
+                    // The error code of the last call is kept
+                    return convertStringZToVariant(value, result);
+                }
+                
                 this->plugin->lastError = RUERR_InvalidParameter;
                 NULL_TO_NPVARIANT(*result);
                 return true;
@@ -240,15 +249,39 @@ static bool objInvoke(NPObject *npobj, NPIdentifier ident,
         }
     }
     
-    // Prevent recursive calls
-    // TODO filter events in the main loop so the browser do anything
-    //      except redraw it's window while a call is in progress.
-    if (pluginActive) return false;
-    pluginActive = true;
+    // Prevent recursive calls on the same object (and multiple windows
+    // appearing for it). Other plugin objects may be called while a call
+    // is in progress, since the browser runs its main loop meanwhile. The
+    // calls are then sent as separate requests (see ipc.c).
+    Plugin *plugin = this->plugin;
+    if (plugin->busy) {
+        // The progress of a call can be checked with GetParam("Status")
+        // while it's running. Other parameters and the error code belong
+        // to the call, so they can't be used until it has returned.
+        if (IS_CALL_1("GetParam", STRING)) {
+            char *param = variantToStringZ(&args[0]);
+            if (!param) return false;
+            
+            char *value = plugin_getStatusParam(plugin, param);
+            free(param);
+            return value && convertStringZToVariant(value, result);
+        }
+        return false;
+    }
+    plugin->busy = true;
+    
+    // All spans in the plugin and signer until the call returns have a new
+    // correlation id in the trace file. Calls on other objects may run in
+    // the meantime, so the id of an outer call is restored afterwards.
+    uint32_t outerTraceId = trace_getId();
+    trace_newId();
+    int64_t traceStart = trace_begin();
     
     bool ok = objInvokeSafe(this, name, args, argCount, result);
     
-    pluginActive = false;
+    trace_end(name, traceStart);
+    trace_setId(outerTraceId);
+    plugin->busy = false;
     return ok;
 }
 
@@ -307,7 +340,9 @@ static NPObject *npobject_new(NPP instance, PluginType pluginType) {
     
     char *url = getDocumentURL(instance);
     char *hostname = getDocumentHostname(instance);
+    int64_t traceStart = trace_begin();
     char *ip = getDocumentIP(instance);
+    trace_end("resolve document IP", traceStart);
 
     obj->plugin = plugin_new(pluginType,
                              (url != NULL ? url : ""),
@@ -32,6 +32,7 @@
 #include <inttypes.h>
 #include <assert.h>
 #include "../common/biderror.h"
+#include "../common/validate.h"
 #include <glib.h> // for g_ascii_strcasecmp
 
 #include "plugin.h"
@@ -85,12 +86,24 @@ static void freeCMCs(RegutilCMC *cmc, bool freeSelf) {
     }
 }
 
+static void freeBatchItems(SignBatchItem *item) {
+    while (item) {
+        SignBatchItem *next = item->next;
+        free(item->challenge);
+        free(item->message);
+        free(item->invisibleMessage);
+        free(item);
+        item = next;
+    }
+}
+
 
 void plugin_free(Plugin *plugin) {
     plugin_reset(plugin);
     free(plugin->url);
     free(plugin->hostname);
     free(plugin->ip);
+    free(plugin->statusLog);
     free(plugin);
 }
 
@@ -115,6 +128,7 @@ void plugin_reset(Plugin *plugin) {
             free(plugin->info.sign.message);
             free(plugin->info.sign.invisibleMessage);
             free(plugin->info.sign.signature);
+            freeBatchItems(plugin->info.sign.batch);
             memset(&plugin->info.sign, 0, sizeof(plugin->info.sign));
             break;
         case PT_Regutil:
@@ -128,6 +142,38 @@ void plugin_reset(Plugin *plugin) {
     setInitialParamValues(plugin);
 }
 
+static const char *const statusNames[] = {
+    "None", "Started", "DialogShown", "TokensFound", "UnlockingKey",
+    "GeneratingKey", "Signing", "Done",
+};
+
+/**
+ * Handles GetParam("Status"), which returns the current step of the
+ * command (and a number, if any, after a colon) and GetParam("StatusLog"),
+ * which returns all steps of the last command with the number of
+ * milliseconds since it was started. Returns NULL for other names.
+ */
+char *plugin_getStatusParam(const Plugin *plugin, const char *name) {
+    if (!g_ascii_strcasecmp(name, "Status")) {
+        const char *statusName = statusNames[plugin->status];
+        switch (plugin->status) {
+            case SignerStatus_TokensFound:
+            case SignerStatus_GeneratingKey:
+            case SignerStatus_Signing: {
+                char *s = malloc(strlen(statusName) + 13);
+                if (s) sprintf(s, "%s:%d", statusName, plugin->statusValue);
+                return s;
+            }
+            default:
+                return strdup(statusName);
+        }
+    }
+    if (!g_ascii_strcasecmp(name, "StatusLog")) {
+        return strdup(plugin->statusLog ? plugin->statusLog : "");
+    }
+    return NULL;
+}
+
 static char **getCommonParamPointer(Plugin *plugin, const char *name) {
     if (!g_ascii_strcasecmp(name, "Policys")) return &plugin->info.auth.policys;
     if (!g_ascii_strcasecmp(name, "Signature")) return &plugin->info.auth.signature;
@@ -188,6 +234,10 @@ char *sign_getParam(Plugin *plugin, const char *name) {
         return strdup(plugin->info.auth.onlyAcceptMRU ? "true" : "false");
     }
     
+    // Progress of the last command
+    char *status = plugin_getStatusParam(plugin, name);
+    if (status) return status;
+    
     // Handle string parameters
     char **valuePtr = getParamPointer(plugin, name);
     
@@ -278,19 +328,103 @@ static bool hasSignParams(const Plugin *plugin) {
     return (plugin->info.auth.challenge);
 }
 
+static char *safestrdup(const char *s) {
+    return (s ? strdup(s) : NULL);
+}
+
+/**
+ * Stores the current nonce and texts as an item of the batch that is
+ * signed with PerformAction("SignBatch").
+ */
+static int addToBatch(Plugin *plugin) {
+    if (!hasSignParams(plugin) || !plugin->info.sign.message) {
+        return BIDERR_MissingParameter;
+    }
+    
+    // Limit number of items and find the end of the list
+    SignBatchItem **last = &plugin->info.sign.batch;
+    size_t count = 0;
+    for (; *last; last = &(*last)->next) {
+        if (++count >= MAX_BATCH_ITEMS) return BIDERR_InternalError;
+    }
+    
+    // Each string is sent as a length, the data and a null terminator
+    size_t length = 3*5 + strlen(plugin->info.sign.challenge) +
+                    strlen(plugin->info.sign.message) +
+                    (plugin->info.sign.invisibleMessage ?
+                     strlen(plugin->info.sign.invisibleMessage) : 0);
+    if (length > MAX_BATCH_LENGTH - plugin->info.sign.batchLength) {
+        return BIDERR_ValueTooLong;
+    }
+    
+    SignBatchItem *item = calloc(1, sizeof(SignBatchItem));
+    if (!item) return BIDERR_InternalError;
+    item->challenge = safestrdup(plugin->info.sign.challenge);
+    item->message = safestrdup(plugin->info.sign.message);
+    item->invisibleMessage = safestrdup(plugin->info.sign.invisibleMessage);
+    
+    if (!item->challenge || !item->message ||
+        (plugin->info.sign.invisibleMessage && !item->invisibleMessage)) {
+        freeBatchItems(item);
+        return BIDERR_InternalError;
+    }
+    
+    *last = item;
+    plugin->info.sign.batchLength += length;
+    return BIDERR_OK;
+}
+
+/**
+ * Checks the page and the items of an authentication or signature. The
+ * signer checks this too, but then it would have to be started first.
+ */
+static int validateSignItems(const Plugin *plugin,
+                             const SignBatchItem *items,
+                             bool authentication) {
+    BankIDError error = validate_origin(plugin->url, plugin->hostname,
+                                        plugin->ip);
+    for (; items && error == BIDERR_OK; items = items->next) {
+        if (!validate_signItem(items, authentication)) {
+            error = BIDERR_InternalError;
+        }
+    }
+    return error;
+}
+
 int sign_performAction(Plugin *plugin, const char *action) {
     int ret = BIDERR_InvalidAction;
+    SignBatchItem item = {
+        NULL, plugin->info.sign.challenge,
+        plugin->info.sign.message, plugin->info.sign.invisibleMessage,
+    };
     
     if ((plugin->type == PT_Authentication) && !g_ascii_strcasecmp(action, "Authenticate")) {
+        item.message = item.invisibleMessage = NULL;
         ret = (hasSignParams(plugin) ?
-            sign_performAction_Authenticate(plugin) : BIDERR_MissingParameter);
+            validateSignItems(plugin, &item, true) : BIDERR_MissingParameter);
+        if (ret == BIDERR_OK) ret = sign_performAction_Authenticate(plugin);
         
     } else if ((plugin->type == PT_Signer) && !g_ascii_strcasecmp(action, "Sign")) {
         if (!hasSignParams(plugin) || !plugin->info.sign.message) {
             return BIDERR_MissingParameter;
         }
-        ret = (hasSignParams(plugin) && plugin->info.sign.message ?
-            sign_performAction_Sign(plugin) : BIDERR_MissingParameter);
+        ret = validateSignItems(plugin, &item, false);
+        if (ret == BIDERR_OK) ret = sign_performAction_Sign(plugin);
+        
+    } else if ((plugin->type == PT_Signer) && !g_ascii_strcasecmp(action, "AddToBatch")) {
+        ret = addToBatch(plugin);
+        
+    } else if ((plugin->type == PT_Signer) && !g_ascii_strcasecmp(action, "SignBatch")) {
+        // The signatures are returned in the Signature parameter,
+        // separated by commas and in the order they were added.
+        // The batch is emptied afterwards.
+        ret = (plugin->info.sign.batch ?
+            validateSignItems(plugin, plugin->info.sign.batch, false) :
+            BIDERR_MissingParameter);
+        if (ret == BIDERR_OK) ret = sign_performAction_SignBatch(plugin);
+        freeBatchItems(plugin->info.sign.batch);
+        plugin->info.sign.batch = NULL;
+        plugin->info.sign.batchLength = 0;
     }
     
     plugin->lastError = ret;
@@ -332,10 +466,6 @@ void regutil_setParam(Plugin *plugin, const char *name, const char *value) {
     }
 }
 
-static char *safestrdup(const char *s) {
-    return (s ? strdup(s) : NULL);
-}
-
 /**
  * Stores the current parameters so they get included with the request.
  */
@@ -48,6 +48,15 @@ typedef struct {
     Window windowId;
     BankIDError lastError;
     
+    /* Set while a method call is in progress (see npobject.c) */
+    bool busy;
+    
+    /* Progress of the last command (see ipc.c) */
+    SignerStatus status;
+    int statusValue;
+    int64_t statusStart;
+    char *statusLog;
+    
     union {
         struct {
             /* Input parameters */
@@ -72,6 +81,9 @@ typedef struct {
             char *invisibleMessage;
             /* Output parameters */
             char *signature;
+            /* Items queued with PerformAction("AddToBatch") */
+            SignBatchItem *batch;
+            size_t batchLength;     /* bytes of the items, see addToBatch */
         } sign;
         struct {
             RegutilCMC currentCMC;
@@ -89,6 +101,7 @@ Plugin *plugin_new(PluginType pluginType, const char *url,
                    Window windowId);
 void plugin_free(Plugin *plugin);
 void plugin_reset(Plugin *plugin);
+char *plugin_getStatusParam(const Plugin *plugin, const char *name);
 
 /* Javascript API */
 char *version_getVersion(Plugin *plugin);
@@ -98,6 +111,7 @@ bool sign_setParam(Plugin *plugin, const char *name, const char *value);
 int sign_performAction(Plugin *plugin, const char *action);
 int sign_performAction_Authenticate(Plugin *plugin);
 int sign_performAction_Sign(Plugin *plugin);
+int sign_performAction_SignBatch(Plugin *plugin);
 // TODO more functions...
 
 void regutil_setParam(Plugin *plugin, const char *name, const char *value);
@@ -105,6 +119,11 @@ void regutil_initRequest(Plugin *plugin, const char *type);
 char *regutil_createRequest(Plugin *plugin);
 void regutil_storeCertificates(Plugin *plugin, const char *certs);
 
+/* Signer process management */
+void ipc_prestartSigner(KeyUsage keyUsage);
+void ipc_setDisplayFd(int fd);
+void ipc_shutdown();
+
 
 #endif
 
@@ -11,6 +11,7 @@
 #include <npruntime.h>
 
 #include <X11/X.h>
+#include <X11/Xlib.h>
 
 #include "pluginutil.h"
 
@@ -170,6 +171,20 @@ Window getWindowId(NPP instance) {
     }
 }
 
+/**
+ * Returns the descriptor of the browser's X server connection, or -1 on
+ * error.
+ */
+int getDisplayFd(NPP instance) {
+    Display *display;
+    if (NPN_GetValue(instance, NPNVxDisplay, &display) == NPERR_NO_ERROR &&
+        display) {
+        return ConnectionNumber(display);
+    } else {
+        return -1;
+    }
+}
+
 bool copyIdentifierName(NPIdentifier ident, char *name, size_t maxLength) {
     char *heapStr = NPN_UTF8FromIdentifier(ident);
     if (!heapStr) return false;
@@ -15,6 +15,7 @@ char *getDocumentURL(NPP instance);
 char *getDocumentHostname(NPP instance);
 char *getDocumentIP(NPP instance);
 Window getWindowId(NPP instance);
+int getDisplayFd(NPP instance);
 bool copyIdentifierName(NPIdentifier ident, char *name, size_t maxLength);
 
 
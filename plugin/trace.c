@@ -0,0 +1,2 @@
+#include "../common/trace.c"
+
@@ -0,0 +1,192 @@
+/*
+
+  Copyright (c) 2026 Samuel Lidén Borell <samuel@kodafritt.se>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+  
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+*/
+
+/*
+  Compares the encoding and decoding cost of the text protocol (IPC 10)
+  and the framed protocol (IPC 12), with and without passing the message
+  in a memfd. The message is a sign request with a 10 MiB message, which
+  is the largest argument that the plugin accepts.
+
+  Usage: ./ipc-bench [runs [megabytes]]
+*/
+
+#define FRIBID_CLIENT 1
+#include "../common/pipe.c"
+
+#include <time.h>
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void encode(FILE *file, const char *message) {
+    pipe_sendCommand(file, PC_Sign);
+    pipe_sendString(file, "https://www.example.com/");
+    pipe_sendString(file, "www.example.com");
+    pipe_sendString(file, "127.0.0.1");
+    pipe_sendInt(file, 0);
+    pipe_sendString(file, "Y2hhbGxlbmdl");
+    pipe_sendInt(file, 1234567890);
+    pipe_sendOptionalString(file, NULL);
+    pipe_sendOptionalString(file, NULL);
+    pipe_sendString(file, "UTF-8");
+    pipe_sendString(file, message);
+    pipe_sendOptionalString(file, NULL);
+    pipe_finishCommand(file);
+}
+
+static bool decode(FILE *file, size_t messageLength) {
+    bool ok = (pipe_readCommand(file) == PC_Sign);
+    free(pipe_readString(file));
+    free(pipe_readString(file));
+    free(pipe_readString(file));
+    ok &= (pipe_readInt(file) == 0);
+    free(pipe_readString(file));
+    ok &= (pipe_readInt(file) == 1234567890);
+    free(pipe_readOptionalString(file));
+    free(pipe_readOptionalString(file));
+    free(pipe_readString(file));
+    char *message = pipe_readLargeString(file);
+    ok &= (strlen(message) == messageLength);
+    pipe_freeString(message);
+    free(pipe_readOptionalString(file));
+    return ok;
+}
+
+static void print(const char *name, long size, double encodeTime,
+                  double decodeTime, int runs) {
+    printf("%-8s %12ld %12.3f %12.3f\n", name, size,
+           encodeTime * 1000 / runs, decodeTime * 1000 / runs);
+}
+
+static void run(const char *name, bool framed, const char *message,
+                int runs) {
+    double encodeTime = 0, decodeTime = 0;
+    long size = 0;
+    FILE *file = tmpfile();
+    if (!file) {
+        perror("tmpfile");
+        exit(1);
+    }
+    // The buffers are kept between runs, like in a running signer process
+    if (framed) pipe_initFramed(file, file);
+    
+    for (int i = 0; i < runs; i++) {
+        rewind(file);
+        
+        double start = now();
+        encode(file, message);
+        encodeTime += now() - start;
+        
+        size = ftell(file);
+        rewind(file);
+        
+        start = now();
+        if (!decode(file, strlen(message))) {
+            fprintf(stderr, "%s: decoded data doesn't match\n", name);
+            exit(1);
+        }
+        decodeTime += now() - start;
+    }
+    
+    if (framed) pipe_close(file, tmpfile());
+    else fclose(file);
+    
+    print(name, size, encodeTime, decodeTime, runs);
+}
+
+/**
+ * Sends the message over a socket, so it's passed in a memfd.
+ */
+static void runSocket(const char *name, const char *message, int runs) {
+    double encodeTime = 0, decodeTime = 0;
+    int sv[2];
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+    FILE *pluginIn = fdopen(sv[0], "r"), *pluginOut = fdopen(dup(sv[0]), "w");
+    FILE *signerIn = fdopen(sv[1], "r"), *signerOut = fdopen(dup(sv[1]), "w");
+    pipe_initFramed(pluginIn, pluginOut);
+    pipe_initFramed(signerIn, signerOut);
+    
+    pipe_sendHello(pluginOut);
+    pipe_sendHello(signerOut);
+    if (!pipe_readHello(signerIn) || !pipe_readHello(pluginIn) ||
+        !(pipe_getFeatures(pluginOut) & PF_FdPassing)) {
+        fprintf(stderr, "%s: descriptor passing is not supported\n", name);
+        exit(1);
+    }
+    
+    for (int i = 0; i < runs; i++) {
+        double start = now();
+        encode(pluginOut, message);
+        encodeTime += now() - start;
+        
+        start = now();
+        if (!decode(signerIn, strlen(message))) {
+            fprintf(stderr, "%s: decoded data doesn't match\n", name);
+            exit(1);
+        }
+        decodeTime += now() - start;
+    }
+    
+    pipe_close(pluginIn, pluginOut);
+    pipe_close(signerIn, signerOut);
+    
+    print(name, 0, encodeTime, decodeTime, runs);
+}
+
+int main(int argc, char **argv) {
+    int runs = (argc > 1 ? atoi(argv[1]) : 20);
+    int megabytes = (argc > 2 ? atoi(argv[2]) : 10);
+    size_t length = (size_t)megabytes*1024*1024;
+    
+    if (runs <= 0 || megabytes < 0) {
+        fprintf(stderr, "usage: %s [runs [megabytes]]\n", argv[0]);
+        return 2;
+    }
+    
+    char *message = malloc(length+1);
+    if (!message) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < length; i++) {
+        message[i] = 'A' + (i % 26);
+    }
+    message[length] = '\0';
+    
+    printf("%-8s %12s %12s %12s\n", "protocol", "bytes", "encode ms",
+           "decode ms");
+    run("text", false, message, runs);
+    run("framed", true, message, runs);
+    runSocket("memfd", message, runs);
+    
+    free(message);
+    return 0;
+}
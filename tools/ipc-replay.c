@@ -0,0 +1,443 @@
+/*
+
+  Copyright (c) 2026 Samuel Lidén Borell <samuel@kodafritt.se>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+  
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+*/
+
+#define _XOPEN_SOURCE 600
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/*
+  Replays IPC transcripts to the signer, and reports the latency of each
+  command. Transcripts are recorded by the plugin when FRIBID_IPC_RECORD
+  is set (the format is described in common/pipe.c).
+  
+  Each recorded session is replayed in a new signer process, which uses
+  the scripted user interface (sign-script.so) so no dialogs are shown.
+  The requests are sent one at a time, and the time until the last reply
+  frame for the request is measured. Cancel requests are skipped, since
+  the scripted dialogs complete immediately.
+  
+  Usage: ipc-replay [-n iterations] [-s signer] [-u ui-module] transcript
+*/
+
+#define RECORD_MAGIC       "FBIDREC1"
+#define RECORD_HEADER_SIZE 16
+#define FRAME_HEADER_SIZE  12
+#define FRAME_MAX_LENGTH   (64*1024*1024)
+#define IPC_OPTION         "--internal--ipc=12"
+
+// Seconds to wait for a reply before giving up
+#define REPLY_TIMEOUT 60
+
+// Must match the PipeFrameType, PipeCommand and PipeRecordDirection enums
+enum { FT_Hello = 1, FT_Request, FT_Response, FT_Status };
+enum { CMD_Cancel = 7, CMD_Prefetch, CMD_Max = CMD_Prefetch };
+enum { DIR_Sent = 0, DIR_Received };
+
+static const char *const commandNames[] = {
+    "Startup", "GetVersion", "Authenticate", "Sign", "CreateRequest",
+    "StoreCertificates", "SignBatch", "Cancel", "Prefetch",
+};
+
+typedef struct Frame {
+    struct Frame *next;
+    uint32_t direction;
+    char header[FRAME_HEADER_SIZE];
+    char *data;
+    uint32_t length;
+} Frame;
+
+typedef struct Session {
+    struct Session *next;
+    uint32_t id;
+    Frame *first, *last;
+} Session;
+
+// Latencies of a command, in microseconds
+typedef struct {
+    double *samples;
+    size_t count, capacity;
+} Latencies;
+
+static Latencies latencies[CMD_Max+1];
+
+extern char **environ;
+
+static uint32_t getUInt32(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return (uint32_t)u[0] | ((uint32_t)u[1] << 8) |
+           ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+static uint16_t getUInt16(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return (uint16_t)(u[0] | (u[1] << 8));
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e6 + ts.tv_nsec/1e3;
+}
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        fprintf(stderr, "ipc-replay: out of memory\n");
+        exit(2);
+    }
+    return p;
+}
+
+/**
+ * Loads a transcript, and groups the frames by session.
+ */
+static Session *loadTranscript(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        perror(filename);
+        return NULL;
+    }
+    
+    char magic[8];
+    if (fread(magic, 8, 1, file) != 1 || memcmp(magic, RECORD_MAGIC, 8)) {
+        fprintf(stderr, "%s: not an IPC transcript\n", filename);
+        fclose(file);
+        return NULL;
+    }
+    
+    Session *sessions = NULL, **lastSession = &sessions;
+    char record[RECORD_HEADER_SIZE];
+    while (fread(record, RECORD_HEADER_SIZE, 1, file) == 1) {
+        Frame *frame = xmalloc(sizeof(Frame));
+        frame->next = NULL;
+        frame->direction = getUInt32(&record[4]);
+        if (fread(frame->header, FRAME_HEADER_SIZE, 1, file) != 1 ||
+            (frame->length = getUInt32(frame->header)) > FRAME_MAX_LENGTH) {
+            fprintf(stderr, "%s: truncated transcript\n", filename);
+            free(frame);
+            break;
+        }
+        frame->data = xmalloc(frame->length);
+        if (frame->length && fread(frame->data, frame->length, 1, file) != 1) {
+            fprintf(stderr, "%s: truncated transcript\n", filename);
+            free(frame->data);
+            free(frame);
+            break;
+        }
+        
+        uint32_t id = getUInt32(&record[0]);
+        Session *session = sessions;
+        while (session && session->id != id) session = session->next;
+        if (!session) {
+            session = xmalloc(sizeof(Session));
+            session->next = NULL;
+            session->id = id;
+            session->first = session->last = NULL;
+            *lastSession = session;
+            lastSession = &session->next;
+        }
+        
+        if (session->last) session->last->next = frame;
+        else session->first = frame;
+        session->last = frame;
+    }
+    
+    fclose(file);
+    return sessions;
+}
+
+static void addLatency(int command, double latency) {
+    Latencies *l = &latencies[command];
+    if (l->count == l->capacity) {
+        l->capacity = (l->capacity ? l->capacity*2 : 64);
+        l->samples = realloc(l->samples, l->capacity*sizeof(double));
+        if (!l->samples) {
+            fprintf(stderr, "ipc-replay: out of memory\n");
+            exit(2);
+        }
+    }
+    l->samples[l->count++] = latency;
+}
+
+typedef struct {
+    pid_t pid;
+    int in, out;
+} Signer;
+
+static bool startSigner(Signer *signer, const char *signerPath) {
+    int toSigner[2], fromSigner[2];
+    if (pipe(toSigner) == -1) return false;
+    if (pipe(fromSigner) == -1) {
+        close(toSigner[0]);
+        close(toSigner[1]);
+        return false;
+    }
+    
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, toSigner[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fromSigner[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, toSigner[1]);
+    posix_spawn_file_actions_addclose(&actions, fromSigner[0]);
+    
+    char *argv[] = {
+        (char *)signerPath, IPC_OPTION, "--internal--persistent", NULL,
+    };
+    int error = posix_spawn(&signer->pid, signerPath, &actions, NULL,
+                            argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    
+    close(toSigner[0]);
+    close(fromSigner[1]);
+    if (error) {
+        fprintf(stderr, "ipc-replay: failed to start %s: %s\n",
+                signerPath, strerror(error));
+        close(toSigner[1]);
+        close(fromSigner[0]);
+        return false;
+    }
+    
+    signer->out = toSigner[1];
+    signer->in = fromSigner[0];
+    return true;
+}
+
+static void stopSigner(Signer *signer) {
+    close(signer->out);
+    close(signer->in);
+    waitpid(signer->pid, NULL, 0);
+}
+
+static bool writeAll(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+static bool readAll(int fd, char *data, size_t length) {
+    while (length > 0) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, REPLY_TIMEOUT*1000);
+        if (ready == 0) {
+            fprintf(stderr, "ipc-replay: timed out waiting for the signer\n");
+            return false;
+        }
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        
+        ssize_t count = read(fd, data, length);
+        if (count == 0) return false;
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += count;
+        length -= count;
+    }
+    return true;
+}
+
+static bool sendFrame(Signer *signer, const Frame *frame) {
+    return writeAll(signer->out, frame->header, FRAME_HEADER_SIZE) &&
+           writeAll(signer->out, frame->data, frame->length);
+}
+
+/**
+ * Reads frames from the signer until a reply frame of the given type
+ * and request id has been received.
+ */
+static bool receiveReply(Signer *signer, uint16_t type, uint32_t requestId) {
+    for (;;) {
+        char header[FRAME_HEADER_SIZE];
+        if (!readAll(signer->in, header, FRAME_HEADER_SIZE)) return false;
+        
+        uint32_t length = getUInt32(&header[0]);
+        if (length > FRAME_MAX_LENGTH) return false;
+        char *data = xmalloc(length);
+        bool ok = readAll(signer->in, data, length);
+        free(data);
+        if (!ok) return false;
+        
+        if (getUInt16(&header[4]) == type &&
+            getUInt32(&header[8]) == requestId) {
+            return true;
+        }
+    }
+}
+
+/**
+ * Counts the recorded replies to a request, i.e. the frames that the
+ * signer sent with the same request id.
+ */
+static int countReplies(const Frame *request) {
+    uint32_t requestId = getUInt32(&request->header[8]);
+    int count = 0;
+    for (const Frame *frame = request->next; frame; frame = frame->next) {
+        if (frame->direction == DIR_Received &&
+            getUInt16(&frame->header[4]) == FT_Response &&
+            getUInt32(&frame->header[8]) == requestId) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Replays a session in a new signer process.
+ */
+static bool replaySession(const Session *session, const char *signerPath) {
+    Signer signer;
+    double start = now();
+    if (!startSigner(&signer, signerPath)) return false;
+    
+    bool ok = true;
+    for (const Frame *frame = session->first; ok && frame;
+         frame = frame->next) {
+        if (frame->direction != DIR_Sent) continue;
+        
+        uint16_t type = getUInt16(&frame->header[4]);
+        if (type == FT_Hello) {
+            // The time until the signer has replied to HELLO
+            ok = sendFrame(&signer, frame) &&
+                 receiveReply(&signer, FT_Hello, 0);
+            if (ok) addLatency(0, now() - start);
+            continue;
+        }
+        
+        int command = (frame->length >= 4 ? (int)getUInt32(frame->data) : 0);
+        if (type == FT_Request && command == CMD_Prefetch) {
+            // There's no reply to this
+            ok = sendFrame(&signer, frame);
+            continue;
+        }
+        if (type != FT_Request || command <= 0 || command >= CMD_Cancel) {
+            continue;
+        }
+        
+        double sent = now();
+        ok = sendFrame(&signer, frame);
+        
+        uint32_t requestId = getUInt32(&frame->header[8]);
+        for (int i = countReplies(frame); ok && i > 0; i--) {
+            ok = receiveReply(&signer, FT_Response, requestId);
+        }
+        if (ok) addLatency(command, now() - sent);
+    }
+    
+    stopSigner(&signer);
+    return ok;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+static double percentile(const Latencies *l, double p) {
+    size_t index = (size_t)(p * (l->count-1) + 0.5);
+    return l->samples[index] / 1000;
+}
+
+static void printReport() {
+    printf("%-18s %7s %9s %9s %9s %9s %9s\n", "command (ms)", "count",
+           "min", "median", "p90", "p99", "max");
+    for (int i = 0; i <= CMD_Max; i++) {
+        Latencies *l = &latencies[i];
+        if (!l->count) continue;
+        
+        qsort(l->samples, l->count, sizeof(double), compareDoubles);
+        printf("%-18s %7zu %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+               commandNames[i], l->count, percentile(l, 0),
+               percentile(l, 0.5), percentile(l, 0.9), percentile(l, 0.99),
+               percentile(l, 1));
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "usage: ipc-replay [-n iterations] [-s signer] "
+                    "[-u ui-module] transcript\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int iterations = 10;
+    const char *signerPath = "../client/sign";
+    const char *uiModule = "./sign-script.so";
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:u:")) != -1) {
+        switch (opt) {
+            case 'n': iterations = atoi(optarg); break;
+            case 's': signerPath = optarg; break;
+            case 'u': uiModule = optarg; break;
+            default: usage();
+        }
+    }
+    if (optind != argc-1 || iterations <= 0) usage();
+    
+    Session *sessions = loadTranscript(argv[optind]);
+    if (!sessions) return 1;
+    
+    // The scripted UI is loaded by the signer, which needs a full path
+    char *uiPath = realpath(uiModule, NULL);
+    setenv("FRIBID_UI_MODULE", (uiPath ? uiPath : uiModule), 1);
+    free(uiPath);
+    signal(SIGPIPE, SIG_IGN);
+    
+    int failed = 0;
+    for (int i = 0; i < iterations; i++) {
+        for (const Session *session = sessions; session;
+             session = session->next) {
+            if (!replaySession(session, signerPath)) failed++;
+        }
+    }
+    
+    printReport();
+    if (failed) {
+        fprintf(stderr, "ipc-replay: %d sessions failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
+
@@ -0,0 +1,300 @@
+/*
+
+  Copyright (c) 2026 Samuel Lidén Borell <samuel@kodafritt.se>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+  
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+*/
+
+/*
+  Measures how long the signer takes to find the tokens in the key
+  directories. The real keystore_addKeyDirectories is used (with the same
+  thread pool, batched reads and key index as in the signer), so this
+  must be linked with the object files of the signer (see the Makefile).
+  
+  The order in which the tokens are delivered is checked against a
+  reference where each file is added with keystore_addFile, one at a time,
+  in the order the files are listed.
+  
+  A corpus of test files (with a throw-away key) can be generated first.
+  The files are put in the cbt subdirectory, and the given directory is
+  used as the home directory when measuring.
+  
+  Usage: ./keyscan-bench generate directory [count]
+         ./keyscan-bench directory [runs]
+*/
+
+#define _POSIX_C_SOURCE 200112
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+#include <openssl/bn.h>
+#include <openssl/evp.h>
+#include <openssl/pkcs12.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include "../client/backend.h"
+#include "../client/keystore.h"
+#include "../client/platform.h"
+
+// Tokens in the order they were delivered: "filename: display name"
+static GPtrArray *delivered;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Creates a self-signed signing certificate with a BankID-like subject
+ * name.
+ */
+static X509 *makeCert(EVP_PKEY *key, int number) {
+    X509 *cert = X509_new();
+    char name[64], serial[24];
+    snprintf(name, sizeof(name), "Test Person %04d", number);
+    snprintf(serial, sizeof(serial), "19700101%04d", number);
+    
+    X509_NAME *subject = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(subject, "C", MBSTRING_UTF8,
+                               (const unsigned char *)"SE", -1, -1, 0);
+    X509_NAME_add_entry_by_txt(subject, "CN", MBSTRING_UTF8,
+                               (const unsigned char *)name, -1, -1, 0);
+    X509_NAME_add_entry_by_txt(subject, "serialNumber", MBSTRING_UTF8,
+                               (const unsigned char *)serial, -1, -1, 0);
+    X509_set_issuer_name(cert, subject);
+    
+    // The signer only lists certificates with the requested key usage
+    X509_EXTENSION *ext = X509V3_EXT_conf_nid(NULL, NULL, NID_key_usage,
+                                              (char *)"nonRepudiation");
+    X509_add_ext(cert, ext, -1);
+    X509_EXTENSION_free(ext);
+    
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), number);
+    X509_gmtime_adj(X509_get_notBefore(cert), 0);
+    X509_gmtime_adj(X509_get_notAfter(cert), 365*24*3600L);
+    X509_set_pubkey(cert, key);
+    X509_sign(cert, key, EVP_sha256());
+    return cert;
+}
+
+static int generate(const char *directory, int count) {
+    gchar *keyDir = g_build_filename(directory, "cbt", NULL);
+    if (g_mkdir_with_parents(keyDir, 0700) != 0) {
+        perror(keyDir);
+        return 1;
+    }
+    
+    // All files have the same key, since generating keys is slow
+    EVP_PKEY *key = EVP_PKEY_new();
+    RSA *rsa = RSA_new();
+    BIGNUM *e = BN_new();
+    BN_set_word(e, RSA_F4);
+    if (!RSA_generate_key_ex(rsa, 2048, e, NULL) ||
+        !EVP_PKEY_assign_RSA(key, rsa)) {
+        fprintf(stderr, "failed to generate a key\n");
+        return 1;
+    }
+    BN_free(e);
+    
+    for (int i = 0; i < count; i++) {
+        X509 *cert = makeCert(key, i);
+        // The certificates are not encrypted, like in BankID key files
+        PKCS12 *p12 = PKCS12_create("1234", "test", key, cert, NULL,
+                                    0, -1, 0, 0, 0);
+        
+        char *filename = g_strdup_printf("%s/test-%04d.p12", keyDir, i);
+        FILE *file = fopen(filename, "wb");
+        if (!p12 || !file || !i2d_PKCS12_fp(file, p12)) {
+            perror(filename);
+            return 1;
+        }
+        fclose(file);
+        g_free(filename);
+        PKCS12_free(p12);
+        X509_free(cert);
+    }
+    
+    EVP_PKEY_free(key);
+    printf("generated %d files in %s\n", count, keyDir);
+    g_free(keyDir);
+    return 0;
+}
+
+/**
+ * Records the tokens in the order they are delivered.
+ */
+static void notifyCallback(Token *token, TokenChange change) {
+    if (change != TokenChange_Added) return;
+    
+    char *displayName = token_getDisplayName(token);
+    g_ptr_array_add(delivered, g_strdup_printf("%s: %s",
+        (const char *)token_getTag(token), displayName ? displayName : ""));
+    free(displayName);
+    token_free(token);
+}
+
+static void clearDelivered() {
+    g_ptr_array_set_size(delivered, 0);
+}
+
+/**
+ * Adds the files in the key directories one at a time, in the order they
+ * are listed (like keystore_addKeyDirectories delivers them).
+ */
+static void addFilesSerially(BackendNotifier *notifier) {
+    char **paths;
+    size_t len;
+    platform_keyDirs(&paths, &len);
+    for (size_t i = 0; i <= len; i++) {
+        PlatformDirIter *dir = platform_openKeysDir(paths[i]);
+        if (dir) {
+            while (platform_iterateDir(dir)) {
+                char *filename = platform_currentPath(dir);
+                if (!strstr(filename, ".tmp")) {
+                    keystore_addFile(notifier, filename);
+                }
+                free(filename);
+            }
+            platform_closeDir(dir);
+        }
+        free(paths[i]);
+    }
+}
+
+/**
+ * Finds the tokens with a new notifier, and returns the time it took.
+ */
+static double scan(bool serially) {
+    clearDelivered();
+    double start = now();
+    BackendNotifier *notifier = backend_createNotifier(NULL,
+        KeyUsage_Signing, notifyCallback);
+    if (serially) {
+        addFilesSerially(notifier);
+    } else {
+        keystore_addKeyDirectories(notifier);
+    }
+    double time = now() - start;
+    backend_freeNotifier(notifier);
+    return time;
+}
+
+/**
+ * Checks that the tokens were delivered in the same order as in the
+ * reference.
+ */
+static bool checkOrder(const GPtrArray *reference, const char *label) {
+    if (delivered->len != reference->len) {
+        fprintf(stderr, "%s: %u tokens, expected %u\n", label,
+                delivered->len, reference->len);
+        return false;
+    }
+    for (guint i = 0; i < reference->len; i++) {
+        if (strcmp(g_ptr_array_index(delivered, i),
+                   g_ptr_array_index(reference, i)) != 0) {
+            fprintf(stderr, "%s: token %u is \"%s\", expected \"%s\"\n",
+                    label, i, (const char *)g_ptr_array_index(delivered, i),
+                    (const char *)g_ptr_array_index(reference, i));
+            return false;
+        }
+    }
+    return true;
+}
+
+typedef struct {
+    const char *label;
+    const char *keyIndex;   // FRIBID_KEY_INDEX
+    const char *ioUring;    // FRIBID_IO_URING
+} Configuration;
+
+static const Configuration configurations[] = {
+    { "no index, read()",   "0", "0" },
+    { "no index, io_uring", "0", "1" },
+    { "key index",          "1", "1" },
+};
+
+int main(int argc, char **argv) {
+    if (argc >= 3 && !strcmp(argv[1], "generate")) {
+        return generate(argv[2], (argc > 3 ? atoi(argv[3]) : 1000));
+    }
+    
+    int runs = (argc > 2 ? atoi(argv[2]) : 5);
+    if (argc < 2 || runs <= 0) {
+        fprintf(stderr, "usage: %s generate directory [count]\n"
+                        "       %s directory [runs]\n",
+                argv[0], argv[0]);
+        return 2;
+    }
+    
+    // The key directories and the key index are in the given directory.
+    // This must be done before GLib looks up the cache directory.
+    gchar *cacheDir = g_build_filename(argv[1], "cache", NULL);
+    setenv("HOME", argv[1], 1);
+    setenv("XDG_CACHE_HOME", cacheDir, 1);
+    g_free(cacheDir);
+    
+    delivered = g_ptr_array_new_with_free_func(g_free);
+    
+    // The serial results are the reference for the other runs
+    setenv("FRIBID_KEY_INDEX", "0", 1);
+    double serialTime = scan(true);
+    GPtrArray *reference = delivered;
+    delivered = g_ptr_array_new_with_free_func(g_free);
+    if (reference->len == 0) {
+        fprintf(stderr, "%s: no tokens found in the key directories\n",
+                argv[1]);
+        return 1;
+    }
+    
+    printf("%u tokens\n", reference->len);
+    printf("%-20s %12s %12s\n", "", "ms", "tokens/s");
+    printf("%-20s %12.1f %12.0f\n", "one file at a time",
+           serialTime * 1000, reference->len / serialTime);
+    
+    for (size_t c = 0; c < G_N_ELEMENTS(configurations); c++) {
+        const Configuration *config = &configurations[c];
+        setenv("FRIBID_KEY_INDEX", config->keyIndex, 1);
+        setenv("FRIBID_IO_URING", config->ioUring, 1);
+        
+        // The first scan creates the key index, if it's enabled
+        scan(false);
+        if (!checkOrder(reference, config->label)) return 1;
+        
+        double time = 0;
+        for (int run = 0; run < runs; run++) {
+            time += scan(false);
+            if (!checkOrder(reference, config->label)) return 1;
+        }
+        time /= runs;
+        printf("%-20s %12.1f %12.0f\n", config->label,
+               time * 1000, reference->len / time);
+    }
+    
+    g_ptr_array_free(reference, TRUE);
+    g_ptr_array_free(delivered, TRUE);
+    return 0;
+}
@@ -0,0 +1,177 @@
+/*
+
+  Copyright (c) 2026 Samuel Lidén Borell <samuel@kodafritt.se>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+  
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+*/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/defines.h"
+#include "../client/backend.h"
+#include "../client/platform.h"
+
+/*
+  Non-interactive user interface, for benchmarks and automated tests.
+  
+  This module can be loaded instead of the GTK module by setting
+  FRIBID_UI_MODULE. No dialog is shown. Instead the first usable token
+  (or the one whose name is in FRIBID_SCRIPT_TOKEN) is used, with the
+  password in FRIBID_SCRIPT_PASSWORD. Each dialog is "submitted" once,
+  and is cancelled if the signer asks again (e.g. after a bad password).
+*/
+
+#define MAX_TOKENS 64
+
+static Token *tokens[MAX_TOKENS];
+static size_t tokenCount = 0;
+static bool submitted = false;
+
+static const char *getPassword() {
+    const char *password = getenv("FRIBID_SCRIPT_PASSWORD");
+    return (password ? password : "");
+}
+
+static void copyPassword(char *password, long password_maxlen) {
+    strncpy(password, getPassword(), password_maxlen-1);
+    password[password_maxlen-1] = '\0';
+}
+
+static void startSign(const char *url, const char *hostname, const char *ip,
+                      unsigned long parentWindowId) {
+    tokenCount = 0;
+    submitted = false;
+}
+
+static void endSign() {
+    // Remove the tokens, like the GTK dialog does. The list is emptied
+    // first, since removeToken is called for each token.
+    Token *removed[MAX_TOKENS];
+    size_t count = tokenCount;
+    memcpy(removed, tokens, count*sizeof(Token*));
+    tokenCount = 0;
+    
+    for (size_t i = 0; i < count; i++) {
+        token_remove(removed[i]);
+    }
+}
+
+static void setNotifier(BackendNotifier *notifier) {
+}
+
+static void setMessage(const char *message) {
+}
+
+static void addToken(Token *token) {
+    if (token_getLastError(token)) return;
+    if (tokenCount < MAX_TOKENS) tokens[tokenCount++] = token;
+}
+
+static void removeToken(Token *token) {
+    for (size_t i = 0; i < tokenCount; i++) {
+        if (tokens[i] == token) {
+            tokens[i] = tokens[--tokenCount];
+            break;
+        }
+    }
+}
+
+/**
+ * Selects the token to use. Returns NULL if there's none.
+ */
+static Token *selectToken() {
+    const char *wanted = getenv("FRIBID_SCRIPT_TOKEN");
+    
+    for (size_t i = 0; i < tokenCount; i++) {
+        if (!wanted) return tokens[i];
+        
+        char *name = token_getDisplayName(tokens[i]);
+        bool found = (name && !strcmp(name, wanted));
+        free(name);
+        if (found) return tokens[i];
+    }
+    return NULL;
+}
+
+static bool sign(Token **token, char *password, int password_maxlen) {
+    if (submitted) return false;
+    submitted = true;
+    
+    *token = selectToken();
+    if (!*token) {
+        fprintf(stderr, BINNAME ": scripted UI: no token to use\n");
+        return false;
+    }
+    copyPassword(password, password_maxlen);
+    return true;
+}
+
+static void startChoosePassword(const char *name,
+                                unsigned long parentWindowId) {
+    submitted = false;
+}
+
+static void setPasswordPolicy(int minLength, int minNonDigits,
+                              int minDigits) {
+}
+
+static void endChoosePassword() {
+}
+
+static bool choosePassword(char *password, long password_maxlen) {
+    if (submitted) return false;
+    submitted = true;
+    
+    copyPassword(password, password_maxlen);
+    return true;
+}
+
+static void showError(TokenError error) {
+    fprintf(stderr, BINNAME ": scripted UI: token error %d\n", (int)error);
+}
+
+static void versionExpiredError() {
+}
+
+/**
+ * Entry point of the module (see client/glibmain.c).
+ */
+const PlatformUI *platform_initUI() {
+    static const PlatformUI ui = {
+        startSign,
+        endSign,
+        setNotifier,
+        setMessage,
+        addToken,
+        removeToken,
+        sign,
+        startChoosePassword,
+        setPasswordPolicy,
+        endChoosePassword,
+        choosePassword,
+        showError,
+        versionExpiredError,
+    };
+    return &ui;
+}
+
@@ -0,0 +1,128 @@
+/*
+
+  Copyright (c) 2026 Samuel Lidén Borell <samuel@kodafritt.se>
+ 
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+  
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+  
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+*/
+
+/*
+  Measures how long it takes to start a process from a large process,
+  using fork()+exec and posix_spawn. The plugin runs inside the browser,
+  which can use several gigabytes of memory, so this shows how the
+  signer start-up time depends on the size of the browser process.
+
+  Usage: ./spawn-latency [max-megabytes [runs [program]]]
+*/
+
+#define _POSIX_C_SOURCE 200112
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long getRSS() {
+    long pages = 0, rss = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file) {
+        if (fscanf(file, "%ld %ld", &pages, &rss) != 2) rss = 0;
+        fclose(file);
+    }
+    return rss * sysconf(_SC_PAGESIZE) / (1024*1024);
+}
+
+static void startFork(char *const argv[]) {
+    pid_t child = fork();
+    if (child == 0) {
+        execvp(argv[0], argv);
+        _exit(1);
+    } else if (child == -1) {
+        perror("fork");
+        exit(1);
+    }
+    waitpid(child, NULL, 0);
+}
+
+static void startSpawn(char *const argv[]) {
+    pid_t child;
+    int error = posix_spawnp(&child, argv[0], NULL, NULL, argv, environ);
+    if (error != 0) {
+        fprintf(stderr, "posix_spawnp: %s\n", strerror(error));
+        exit(1);
+    }
+    waitpid(child, NULL, 0);
+}
+
+static double measure(void (*start)(char *const []), char *const argv[],
+                      int runs) {
+    double begin = now();
+    for (int i = 0; i < runs; i++) {
+        start(argv);
+    }
+    return (now() - begin) * 1000 / runs;
+}
+
+int main(int argc, char **argv) {
+    int maxSize = (argc > 1 ? atoi(argv[1]) : 4096);
+    int runs = (argc > 2 ? atoi(argv[2]) : 20);
+    char *program[] = { (argc > 3 ? argv[3] : "true"), NULL };
+    char *memory = NULL;
+    int size = 0;
+    
+    if (maxSize < 0 || runs <= 0) {
+        fprintf(stderr, "usage: %s [max-megabytes [runs [program]]]\n",
+                argv[0]);
+        return 2;
+    }
+    
+    printf("%10s %10s %12s %12s\n", "alloc MB", "RSS MB", "fork ms",
+           "spawn ms");
+    for (;;) {
+        // Touch all pages, so they are actually mapped
+        memory = realloc(memory, size ? (size_t)size*1024*1024 : 1);
+        if (!memory) {
+            perror("realloc");
+            return 1;
+        }
+        if (size) memset(memory, 1, (size_t)size*1024*1024);
+        
+        printf("%10d %10ld %12.3f %12.3f\n", size, getRSS(),
+               measure(startFork, program, runs),
+               measure(startSpawn, program, runs));
+        fflush(stdout);
+        
+        if (size >= maxSize) break;
+        size = (size ? size*2 : 64);
+        if (size > maxSize) size = maxSize;
+    }
+    
+    free(memory);
+    return 0;
+}